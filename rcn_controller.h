@@ -10,6 +10,36 @@
 #define RCN_CTRL_MAX_CHANNELS 1
 #endif
 
+/// Minimum number of milliseconds between batches of notifications
+#ifndef RCN_CTRL_NOTIFY_INTERVAL
+#define RCN_CTRL_NOTIFY_INTERVAL 0
+#endif
+
+/// Number of milliseconds to wait for a status update after a request
+#ifndef RCN_CTRL_REPLY_TIMEOUT
+#define RCN_CTRL_REPLY_TIMEOUT 500
+#endif
+
+/// Number of consecutive missed replies before going offline
+#ifndef RCN_CTRL_OFFLINE_MISSES
+#define RCN_CTRL_OFFLINE_MISSES 3
+#endif
+
+/// Number of milliseconds between status requests while offline
+#ifndef RCN_CTRL_PROBE_INTERVAL
+#define RCN_CTRL_PROBE_INTERVAL 5000
+#endif
+
+/// Max. bytes of RAM used by RCN_Controller (0 = no limit; see rcn_host.h)
+#ifndef RCN_CTRL_RAM_BUDGET
+#define RCN_CTRL_RAM_BUDGET 0
+#endif
+
+/// RCN_BasicNode features used by RCN_Controller (see rcn_node.h)
+#ifndef RCN_CTRL_NODE_FEATURES
+#define RCN_CTRL_NODE_FEATURES (RCN_TX_UR | RCN_RECV | RCN_SLEEP | RCN_STATS)
+#endif
+
 #define LIMIT(min, val, max) (min > val ? min : (max < val) ? max : val)
 
 const byte remote_host = 1; // RFM12B node ID of remote RCN node. TODO: Allow multiple remote hosts
@@ -26,6 +56,14 @@ public:
 	 * the callback function should probably not automatically cause
 	 * further channel updates. Instead, the callback function is
 	 * intended to provide feedback to the user of the channel update.
+	 *
+	 * Notifications are not delivered synchronously. Instead, updated
+	 * channels are collected, and delivered together from run(), at
+	 * most once every RCN_CTRL_NOTIFY_INTERVAL milliseconds. A channel
+	 * that is updated several times between two deliveries is only
+	 * notified once, with 'old_level' being the level passed in its
+	 * previous notification. Hence, the cost of updating the UI is
+	 * bounded regardless of the amount of network traffic.
 	 */
 	typedef void (*update_notifier) (
 		uint8_t channel, // The channel id
@@ -34,33 +72,195 @@ public:
 		uint8_t old_level, // The old/previous level
 		uint8_t new_level); // The new/current level
 
+	/*
+	 * A UI that redraws all channels at once (e.g. an LED bar or a
+	 * display) should rather set a batch notifier (see
+	 * set_batch_notifier()), which is invoked once per batch, after the
+	 * update_notifier calls for the batch (pass 0 for the
+	 * update_notifier to skip those). It is given a bitmap of the
+	 * channels updated in the batch (bit (i % 8) of changed[i / 8] is
+	 * set if channel #i was updated), along with the old and new levels
+	 * of all channels, where the old level of a channel is the level
+	 * passed in its previous notification.
+	 */
+	typedef void (*batch_notifier) (
+		const uint8_t *changed, // Bitmap of updated channels
+		const uint8_t *old_level, // Old/previous levels of all channels
+		const uint8_t *new_level, // New/current levels of all channels
+		size_t num_channels); // Number of channels
+
 private:
-	RCN_Node node;
+	typedef RCN_BasicNode<RCN_CTRL_NODE_FEATURES> Node;
+
+	Node node;
 	update_notifier notifier;
+	batch_notifier batch_hook;
 	size_t n_channels; // Number of active channels
 	uint8_t range[RCN_CTRL_MAX_CHANNELS]; // channel ranges
 	uint8_t level[RCN_CTRL_MAX_CHANNELS]; // channel levels
 	uint8_t data[RCN_CTRL_MAX_CHANNELS]; // auxiliary channel data
+	uint8_t notified[RCN_CTRL_MAX_CHANNELS]; // last notified levels
+	uint8_t dirty[(RCN_CTRL_MAX_CHANNELS + 7) / 8]; // pending notify
+	unsigned long last_notify; // millis() at last notification batch
+
+	/*
+	 * Logical timestamps (see rcn_node.h) keep us from flip-flopping
+	 * when another controller adjusts the same channel: 'clock' is the
+	 * newest timestamp we have seen or sent, and 'pending' is the
+	 * timestamp of our own update request in flight, per channel. Status
+	 * updates overtaken by our own request are ignored. If a request is
+	 * lost, its reply never comes, so all 'pending' timestamps are
+	 * forgotten RCN_CTRL_REPLY_TIMEOUT ms after the last request was
+	 * sent.
+	 */
+	uint8_t clock;
+	uint8_t pending[RCN_CTRL_MAX_CHANNELS];
+	bool stamped; // Set while any 'pending' timestamps are set
+	unsigned long stamped_at; // millis() when the last one was set
+
+	/*
+	 * When the remote host stops replying to our requests, we go
+	 * offline, and stop sending update requests. Instead, we remember
+	 * the user's intent per channel: either "set the channel to its
+	 * current (local) level", or "adjust the channel by the given
+	 * amount". Once a status update shows that the host is back, all
+	 * intents are sent in one go. Hence, the memory needed is
+	 * proportional to the number of channels, not to the number of user
+	 * actions.
+	 */
+	enum { NO_INTENT, ABS_INTENT, REL_INTENT };
+	uint8_t intent[RCN_CTRL_MAX_CHANNELS]; // pending intent per channel
+	int8_t intent_delta[RCN_CTRL_MAX_CHANNELS]; // REL_INTENT amount
+	bool offline; // Set while the remote host is unreachable
+	bool awaiting; // Set while waiting for a reply from the remote host
+	uint8_t misses; // Number of consecutive replies missed
+	unsigned long await_since; // millis() when 'awaiting' was set
+	unsigned long last_probe; // millis() at last status request offline
+
+	/// Return the timestamp for a new update request on the channel.
+	uint8_t stamp(uint8_t channel)
+	{
+		clock = RCN_Stamp::next(clock);
+		pending[channel] = clock;
+		stamped = true;
+		stamped_at = millis();
+		return clock;
+	}
+
+	/// Note that we expect a status update from the remote host.
+	void expect_reply()
+	{
+		if (!awaiting) {
+			awaiting = true;
+			await_since = millis();
+		}
+	}
+
+	/// Check for missed replies, and probe the host while offline.
+	void check_online()
+	{
+		unsigned long now = millis();
+		if (stamped && now - stamped_at >= RCN_CTRL_REPLY_TIMEOUT) {
+			stamped = false;
+			memset(pending, RCN_Stamp::NONE, sizeof(pending));
+		}
+		if (awaiting && now - await_since >= RCN_CTRL_REPLY_TIMEOUT) {
+			awaiting = false;
+			if (++misses >= RCN_CTRL_OFFLINE_MISSES)
+				offline = true;
+		}
+		if (offline && now - last_probe >= RCN_CTRL_PROBE_INTERVAL) {
+			node.send_status_request(remote_host, 0);
+			last_probe = now;
+		}
+	}
+
+	/**
+	 * Send the intents collected while offline.
+	 *
+	 * These are sent without timestamps: we have not seen the writes
+	 * made by others while we were offline, so any timestamp we could
+	 * give our requests may be one that the host has moved past, and
+	 * unstamped requests are always accepted.
+	 */
+	void go_online()
+	{
+		offline = false;
+		for (size_t i = 0; i < n_channels; i++) {
+			if (intent[i] == ABS_INTENT)
+				node.send_update_request_abs(
+					remote_host, i, level[i]);
+			else if (intent[i] == REL_INTENT && intent_delta[i])
+				node.send_update_request_rel(
+					remote_host, i, intent_delta[i]);
+			intent[i] = NO_INTENT;
+		}
+	}
 
 	/// This is auto-invoked when a channel level changes.
 	uint8_t update(uint8_t channel, int value)
 	{
+		RCN_PROFILE_SCOPE(RCN_PROF_CTRL_UPDATE);
 		assert(channel < n_channels);
 		uint8_t v = LIMIT(0, value, range[channel]);
-		notifier(channel, range[channel], data[channel],
-			 level[channel], v);
 		level[channel] = v;
+		dirty[channel / 8] |= 1 << (channel % 8);
 		return v;
 	}
 
+	/// Deliver pending notifications, unless we did so too recently.
+	void notify()
+	{
+		unsigned long now = millis();
+#if RCN_CTRL_NOTIFY_INTERVAL
+		if (now - last_notify < RCN_CTRL_NOTIFY_INTERVAL)
+			return;
+#endif
+
+		uint8_t changed[sizeof(dirty)];
+		bool any = false;
+		for (size_t i = 0; i < sizeof(dirty); i++) {
+			changed[i] = dirty[i];
+			any |= changed[i];
+		}
+		if (!any)
+			return;
+		memset(dirty, 0, sizeof(dirty));
+
+		for (size_t i = 0; notifier && i < n_channels; i++)
+			if (changed[i / 8] & (1 << (i % 8)))
+				notifier(i, range[i], data[i], notified[i],
+					level[i]);
+		if (batch_hook)
+			batch_hook(changed, notified, level, n_channels);
+		for (size_t i = 0; i < n_channels; i++)
+			if (changed[i / 8] & (1 << (i % 8)))
+				notified[i] = level[i];
+		last_notify = now;
+	}
+
 public:
 	RCN_Controller(
 		uint8_t rf12_band, uint8_t rf12_group, uint8_t rf12_node,
 		update_notifier notifier)
 	: node(rf12_band, rf12_group, rf12_node),
 	  notifier(notifier),
-	  n_channels(0)
+	  batch_hook(0),
+	  n_channels(0),
+	  last_notify(0),
+	  clock(RCN_Stamp::NONE),
+	  stamped(false),
+	  stamped_at(0),
+	  offline(false),
+	  awaiting(false),
+	  misses(0),
+	  await_since(0),
+	  last_probe(0)
 	{
+		static_assert(!RCN_CTRL_RAM_BUDGET
+			|| sizeof(RCN_Controller) <= RCN_CTRL_RAM_BUDGET,
+			"RCN_Controller exceeds RCN_CTRL_RAM_BUDGET");
+		memset(dirty, 0, sizeof(dirty));
 	}
 
 	void init()
@@ -75,6 +275,9 @@ public:
 		range[channel] = r;
 		level[channel] = l;
 		data[channel] = d;
+		notified[channel] = l;
+		intent[channel] = NO_INTENT;
+		pending[channel] = RCN_Stamp::NONE;
 		update(channel, l);
 		sync(channel);
 	}
@@ -84,76 +287,115 @@ public:
 		return n_channels;
 	}
 
+	/// Set the batch notifier (see batch_notifier above), or 0 for none.
+	void set_batch_notifier(batch_notifier n)
+	{
+		batch_hook = n;
+	}
+
 	uint8_t get(uint8_t channel) const
 	{
 		assert(channel < n_channels);
 		return level[channel];
 	}
 
+	/// Return false while the remote host is considered unreachable.
+	bool online() const
+	{
+		return !offline;
+	}
+
 	/// Call this to request a status update from the remote host.
 	void sync(uint8_t channel)
 	{
-		node.send_status_request(remote_host, channel);
+		if (offline)
+			return; // We're already probing the remote host
+		// Stamp the request with the newest timestamp we know of,
+		// so that the reply supersedes our own pending requests.
+		node.send_status_request(remote_host, channel, clock);
+		expect_reply();
 	}
 
 	/// Call this to change the absolute level of the given channel.
 	uint8_t set(uint8_t channel, int value)
 	{
+		RCN_PROFILE_SCOPE(RCN_PROF_CTRL_SET);
 		uint8_t ret = update(channel, value);
+		if (offline) {
+			intent[channel] = ABS_INTENT;
+			return ret;
+		}
 		// Send update request to remote host
-		node.send_update_request_abs(remote_host, channel, ret);
+		node.send_update_request_abs(remote_host, channel, ret,
+			stamp(channel));
+		expect_reply();
 		return ret;
 	}
 
 	/// Call this to relatively adjust the level of the given channel.
 	uint8_t adjust(uint8_t channel, int delta)
 	{
+		RCN_PROFILE_SCOPE(RCN_PROF_CTRL_ADJUST);
 		int8_t d = LIMIT(-128, delta, 127);
 		uint8_t ret = update(channel, level[channel] + delta);
+		if (offline) {
+			if (intent[channel] == ABS_INTENT)
+				return ret; // Will send level[] anyway
+			int sum = (intent[channel] == REL_INTENT
+				? intent_delta[channel] : 0) + d;
+			intent[channel] = REL_INTENT;
+			intent_delta[channel] = LIMIT(-128, sum, 127);
+			return ret;
+		}
 		// Send update request to remote host
-		if (d)
+		if (d) {
 			node.send_update_request_rel(
-				remote_host, channel, d);
+				remote_host, channel, d, stamp(channel));
+			expect_reply();
+		}
 		return ret;
 	}
 
 	/// Call this method often to keep things running smoothly.
 	void run(void)
 	{
-		RCN_Node::RecvPacket p;
-		if (!node.send_and_recv(p))
-			return;
+		RCN_PROFILE_SCOPE(RCN_PROF_CTRL_RUN);
+		node.send_and_recv(*this);
+		check_online();
+		notify();
+	}
 
-		if (p.channel() >= n_channels) {
-#ifdef DEBUG
-			LOG(F("Illegal channel number: "));
-			LOGln(p.channel());
-#endif
-			return;
-		}
+	/**
+	 * Return the node's counters of network activity (see
+	 * RCN_BasicNode::stats()). Needs RCN_STATS in RCN_CTRL_NODE_FEATURES.
+	 *
+	 * These are templates only to keep them from being compiled (and
+	 * failing the node's static_assert) when RCN_STATS is left out.
+	 */
+	template <class N = Node>
+	const RCN_Stats& stats() const
+	{
+		return static_cast<const N&>(node).stats();
+	}
 
-		if (p.relative()) {
-#ifdef DEBUG
-			LOGln(F("Status update should not have relative "
-				"level!"));
-#endif
-			return;
-		}
+	template <class N = Node>
+	void reset_stats()
+	{
+		static_cast<N&>(node).reset_stats();
+	}
 
-#ifdef DEBUG
-		LOG(F("Received status update for channel #"));
-		LOG(p.channel());
-		LOG(F(": "));
-		LOG(get(p.channel()));
-		LOG(F(" -> "));
-		LOGln(p.abs_level());
-#endif
-		update(p.channel(), p.abs_level());
+	/// Write the node's event trace (see rcn_trace.h) to 'out'
+	template <class Out>
+	void dump_trace(Out& out) const
+	{
+		node.dump_trace(out);
 	}
 
+	/// Turn off the radio (needs RCN_SLEEP; templated as stats() below)
+	template <class N = Node>
 	bool go_to_sleep()
 	{
-		return node.go_to_sleep();
+		return static_cast<N&>(node).go_to_sleep();
 	}
 
 	/**
@@ -162,15 +404,66 @@ public:
 	 * Pass reset = true, if you want to temporarily reset cached
 	 * levels to zero while waiting for status updates from host.
 	 */
+	template <class N = Node>
 	void wake_up(bool reset = false)
 	{
-		node.wake_up();
+		static_cast<N&>(node).wake_up();
+		awaiting = false; // Don't blame the host for our sleeping
 
 		if (reset) {
 			for (size_t i = 0; i < n_channels; i++)
 				update(i, 0);
 		}
 	}
+
+private:
+	template <uint8_t> friend class RCN_BasicNode;
+
+	void on_status_update(uint8_t host, uint8_t channel, uint8_t level,
+		uint8_t s)
+	{
+		if (host != remote_host)
+			return;
+
+		if (channel >= n_channels) {
+			node.debug(RCN_LOG_BAD_CHANNEL, channel);
+			return;
+		}
+
+		// The remote host is alive
+		awaiting = false;
+		misses = 0;
+		clock = RCN_Stamp::adopt(clock, s);
+		if (offline) {
+			// Our own pending absolute level wins over this one
+			bool intended = intent[channel] == ABS_INTENT;
+			go_online();
+			if (intended)
+				return;
+		}
+
+		if (RCN_Stamp::overtaken(s, pending[channel]))
+			return; // Our own request in flight supersedes this
+		pending[channel] = RCN_Stamp::NONE;
+
+		node.debug(RCN_LOG_CTRL_UPDATE, channel, get(channel), level);
+		update(channel, level);
+	}
+
+	void on_update_request_abs(uint8_t, uint8_t, uint8_t)
+	{
+		// Update requests are only meant for hosts
+	}
+
+	void on_update_request_rel(uint8_t, int8_t, uint8_t)
+	{
+		// Update requests are only meant for hosts
+	}
+
+	void on_status_request(uint8_t, uint8_t)
+	{
+		// Status requests are only meant for hosts
+	}
 };
 
 #endif // RCN_CONTROLLER_H
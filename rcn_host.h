@@ -10,46 +10,544 @@
 #define RCN_HOST_MAX_CHANNELS 1
 #endif
 
+/// Set this to the number of channels with reporting policies (see below)
+#ifndef RCN_HOST_MAX_POLICIES
+#define RCN_HOST_MAX_POLICIES 0
+#endif
+
+/// Set this to the number of virtual channels (see below)
+#ifndef RCN_HOST_MAX_VIRTUAL
+#define RCN_HOST_MAX_VIRTUAL 0
+#endif
+
+/// Set this to the number of timer channels (see add_timer_channel())
+#ifndef RCN_HOST_MAX_TIMERS
+#define RCN_HOST_MAX_TIMERS 0
+#endif
+
+/// Number of slots in the timer wheel (must be a power of two)
+#ifndef RCN_HOST_TIMER_SLOTS
+#define RCN_HOST_TIMER_SLOTS 8
+#endif
+
+/// Milliseconds per timer tick
+#ifndef RCN_HOST_TICK_MS
+#define RCN_HOST_TICK_MS 100
+#endif
+
+/// Milliseconds over which reporting policies measure rates of change
+#ifndef RCN_HOST_RATE_WINDOW
+#define RCN_HOST_RATE_WINDOW 200
+#endif
+
+/*
+ * Set this to the max. number of bytes of RAM that a host object may use
+ * (0 means no limit). The size of a host grows with the number of
+ * channels, policies, virtual channels and timers, and with the size of
+ * the node's send buffer (RCN_SEND_BUF_SIZE in rcn_node.h). Exceeding
+ * the budget fails the build, rather than the stack running into the
+ * host's data at runtime.
+ */
+#ifndef RCN_HOST_RAM_BUDGET
+#define RCN_HOST_RAM_BUDGET 0
+#endif
+
+/// RCN_BasicNode features used by hosts (see rcn_node.h)
+#ifndef RCN_HOST_NODE_FEATURES
+#define RCN_HOST_NODE_FEATURES (RCN_TX_SU | RCN_RECV | RCN_SLEEP | RCN_STATS)
+#endif
+
 #define LIMIT(min, val, max) (min > val ? min : (max < val) ? max : val)
 
-class RCN_Host
+/*
+ * Whenever a channel is about to be updated, the update is
+ * filtered through a callback function, which allows the user
+ * to react and/or change the update. All the registered details
+ * for the relevant channel is passed to this function, along with
+ * the current/old and proposed/new value. The function is
+ * expected to return the actual new value that will be stored.
+ *
+ * As such, if the function wishes to reject the new value, it
+ * merely returns 'old_level', while if it wishes to adopt the
+ * new value, it should return 'new_level'. Otherwise, any return
+ * value within 0 <= retval <= range is valid.
+ */
+typedef uint8_t (*RCN_UpdateFilter) (
+	uint8_t channel, // The channel id
+	uint8_t range, // The registered range for this channel
+	uint8_t data, // The auxiliary data for this channel
+	uint8_t old_level, // The old/current level
+	uint8_t new_level); // The proposed new level
+
+/*
+ * Hosts driving shift registers, PWM chips or DMX buffers typically want
+ * to push their whole output state in one bus transaction, rather than
+ * once per updated channel. For this, the update filter should only
+ * decide on the new level, and leave the actual output to an optional
+ * commit hook. The commit hook is invoked at most once per call to
+ * run(), after all updates in that call have been applied, with a bitmap
+ * of the channels whose level has changed since the last commit (bit
+ * (i % 8) of changed[i / 8] is set if channel #i has changed), and the
+ * current levels of all channels.
+ */
+typedef void (*RCN_CommitHook) (
+	const uint8_t *changed, // Bitmap of changed channels
+	const uint8_t *level, // Current levels of all channels
+	size_t num_channels); // Number of channels
+
+/*
+ * A virtual channel has no level of its own, but derives it from other
+ * channels of the same host (e.g. a master volume scaling a number of
+ * outputs, a balance control, or a group of linked channels). The derive
+ * function is given the registered details of the virtual channel, and
+ * the current levels of all channels, and returns the derived level,
+ * which is then passed through the update filter like any other update.
+ */
+typedef uint8_t (*RCN_DeriveFunc) (
+	uint8_t channel, // The virtual channel id
+	uint8_t range, // The registered range for this channel
+	uint8_t data, // The auxiliary data for this channel
+	const uint8_t *level); // Current levels of all channels
+
+/*
+ * Compile-time list of per-channel handlers.
+ *
+ * Instead of routing every channel through a single update_filter
+ * function pointer (which typically ends up as a big switch on 'channel'
+ * and 'data'), each channel may be given its own handler type. Channel
+ * #0 is handled by the first type in the list, channel #1 by the second,
+ * and so on. Each handler type must provide a static function with the
+ * same signature as RCN_UpdateFilter:
+ *
+ *   struct Volume {
+ *     static uint8_t update(uint8_t channel, uint8_t range,
+ *       uint8_t data, uint8_t old_level, uint8_t new_level);
+ *   };
+ *
+ * Since the handlers are known at compile time, the dispatch below is
+ * a chain of comparisons against constants, which the compiler is free
+ * to fully inline or turn into an index-based jump table.
+ */
+template <uint8_t Index, class... Handlers>
+class RCN_Dispatch
+{
+public:
+	static uint8_t update(uint8_t, uint8_t, uint8_t, uint8_t old_level,
+		uint8_t)
+	{
+		return old_level; // Unknown channel; reject update
+	}
+};
+
+template <uint8_t Index, class First, class... Rest>
+class RCN_Dispatch<Index, First, Rest...>
+{
+public:
+	static uint8_t update(uint8_t channel, uint8_t range, uint8_t data,
+		uint8_t old_level, uint8_t new_level)
+	{
+		if (channel == Index)
+			return First::update(channel, range, data,
+				old_level, new_level);
+		return RCN_Dispatch<Index + 1, Rest...>::update(
+			channel, range, data, old_level, new_level);
+	}
+};
+
+template <class... Handlers>
+class RCN_Handlers
 {
 public:
+	uint8_t operator()(uint8_t channel, uint8_t range, uint8_t data,
+		uint8_t old_level, uint8_t new_level) const
+	{
+		return RCN_Dispatch<0, Handlers...>::update(
+			channel, range, data, old_level, new_level);
+	}
+};
+
+/*
+ * Common host implementation, parameterized on the type of the update
+ * filter (anything callable with the RCN_UpdateFilter signature) and
+ * on the maximum number of channels.
+ */
+template <class Filter, size_t MaxChannels>
+class RCN_HostBase
+{
+private:
+	typedef RCN_BasicNode<RCN_HOST_NODE_FEATURES> Node;
+
+	Node node;
+	Filter handler;
+	size_t num_channels; // Number of active channels
+	uint8_t range[MaxChannels]; // channel ranges
+	uint8_t level[MaxChannels]; // channel levels
+	uint8_t data[MaxChannels]; // auxiliary channel data
+	uint8_t stamp[MaxChannels]; // timestamp of last write (RCN_Stamp)
+	uint8_t unstamped[(MaxChannels + 7) / 8]; // changed, not reported
+	uint8_t changed[(MaxChannels + 7) / 8]; // changed since last commit
+	RCN_CommitHook commit_hook;
+	bool asleep; // Set once go_to_sleep() has queued the sleep marker
+
+#if RCN_HOST_MAX_POLICIES
+	class ReportPolicy
+	{
+	public:
+		uint8_t channel; // The channel this policy applies to
+		uint8_t deadband; // Ignore changes smaller than or equal to this
+		uint8_t rate; // Report faster changes (levels/sec) at once
+		uint16_t min_interval; // Min. time between reports (1/10 sec)
+		uint16_t max_interval; // Max. time between reports (1/10 sec)
+		uint8_t reported; // Last reported level
+		unsigned long reported_at; // millis() at last report
+		uint8_t window_level; // Level at start of rate window
+		unsigned long window_at; // millis() at start of rate window
+	};
+
+	size_t num_policies; // Number of active reporting policies
+	ReportPolicy policy[RCN_HOST_MAX_POLICIES];
+
+	/// Return the reporting policy for the given channel, if any
+	ReportPolicy *find_policy(uint8_t channel)
+	{
+		for (size_t i = 0; i < num_policies; i++)
+			if (policy[i].channel == channel)
+				return policy + i;
+		return 0;
+	}
+#endif
+
+#if RCN_HOST_MAX_VIRTUAL
+	class VirtualChannel
+	{
+	public:
+		uint8_t channel; // The virtual channel
+		RCN_DeriveFunc derive; // Computes its level from its inputs
+		uint8_t inputs[(MaxChannels + 7) / 8]; // Bitmap of inputs
+	};
+
+	size_t num_virtual; // Number of virtual channels
+	VirtualChannel virt[RCN_HOST_MAX_VIRTUAL]; // Sorted by channel
+
+	/// Recompute the given virtual channel, and report any change.
+	void derive(const VirtualChannel *v)
+	{
+		uint8_t c = v->channel;
+		uint8_t old_level = level[c];
+		apply(c, v->derive(c, range[c], data[c], level));
+		if (level[c] != old_level && !deferred(c))
+			report(c);
+	}
+#endif
+
+#if RCN_HOST_MAX_TIMERS
+	static_assert(RCN_HOST_TIMER_SLOTS
+		&& !(RCN_HOST_TIMER_SLOTS & (RCN_HOST_TIMER_SLOTS - 1)),
+		"RCN_HOST_TIMER_SLOTS must be a power of two");
+	static const uint8_t NO_TIMER = 0xff;
+
 	/*
-	 * Whenever a channel is about to be updated, the update is
-	 * filtered through a callback function, which allows the user
-	 * to react and/or change the update. All the registered details
-	 * for the relevant channel is passed to this function, along with
-	 * the current/old and proposed/new value. The function is
-	 * expected to return the actual new value that will be stored.
+	 * Timers are kept in a hashed timer wheel: each slot holds a linked
+	 * list of the timers expiring at that tick modulo the number of
+	 * slots, and 'rounds' counts the full turns of the wheel left before
+	 * a timer expires. Each tick only visits the timers in one slot.
+	 */
+	class Timer
+	{
+	public:
+		uint8_t channel; // The timer channel
+		uint8_t target; // The channel to change on expiry
+		uint8_t fire_level; // The level to set/ramp 'target' to
+		uint8_t step; // Ramp step per tick, or 0 to set at once
+		uint16_t unit; // Ticks per level unit of the timer channel
+		bool ramping; // Set while ramping 'target' (once per tick)
+		uint8_t slot; // The wheel slot holding this timer, or NO_TIMER
+		uint8_t next; // The next timer in the same slot, or NO_TIMER
+		unsigned long rounds; // Turns of the wheel left before expiry
+	};
+
+	size_t num_timers; // Number of timer channels
+	Timer timer[RCN_HOST_MAX_TIMERS];
+	uint8_t wheel[RCN_HOST_TIMER_SLOTS]; // First timer in each slot
+	uint8_t tick; // The wheel slot of the current tick
+	unsigned long tick_at; // millis() at the current tick
+
+	Timer *find_timer(uint8_t channel)
+	{
+		for (size_t i = 0; i < num_timers; i++)
+			if (timer[i].channel == channel)
+				return timer + i;
+		return 0;
+	}
+
+	/// Remove the given timer from the wheel, if it is there.
+	void unlink_timer(Timer *t)
+	{
+		if (t->slot == NO_TIMER)
+			return;
+		uint8_t id = t - timer;
+		uint8_t *p = wheel + t->slot;
+		while (*p != id)
+			p = &timer[*p].next;
+		*p = t->next;
+		t->slot = NO_TIMER;
+	}
+
+	/// (Re)insert the given timer to expire after 'ticks' (> 0) ticks.
+	void arm_timer(Timer *t, unsigned long ticks)
+	{
+		unlink_timer(t);
+		t->slot = (tick + ticks) & (RCN_HOST_TIMER_SLOTS - 1);
+		t->rounds = (ticks - 1) / RCN_HOST_TIMER_SLOTS;
+		t->next = wheel[t->slot];
+		wheel[t->slot] = t - timer;
+	}
+
+	/// Move the timer's target one step closer to its 'fire_level'.
+	void expire_timer(Timer *t)
+	{
+		if (!t->ramping) {
+			set(t->channel, 0); // Report that the timer fired
+			t->ramping = t->step;
+		}
+		uint8_t old_level = level[t->target];
+		int l = t->fire_level;
+		if (t->ramping && old_level + t->step < l)
+			l = old_level + t->step;
+		else if (t->ramping && old_level - t->step > l)
+			l = old_level - t->step;
+		set(t->target, l);
+		if (t->ramping && level[t->target] != t->fire_level
+		    && level[t->target] != old_level)
+			arm_timer(t, 1);
+		else
+			t->ramping = false;
+	}
+
+	/// Advance the wheel to the current time, expiring due timers.
+	void run_timers()
+	{
+		while (millis() - tick_at >= RCN_HOST_TICK_MS) {
+			tick_at += RCN_HOST_TICK_MS;
+			tick = (tick + 1) & (RCN_HOST_TIMER_SLOTS - 1);
+			uint8_t i = wheel[tick];
+			while (i != NO_TIMER) {
+				Timer *t = timer + i;
+				i = t->next;
+				if (t->rounds) {
+					t->rounds--;
+					continue;
+				}
+				unlink_timer(t);
+				expire_timer(t);
+			}
+		}
+	}
+#endif
+
+	/// (Re)arm or cancel the timer, if the given channel is a timer.
+	void timer_changed(uint8_t channel)
+	{
+#if RCN_HOST_MAX_TIMERS
+		Timer *t = find_timer(channel);
+		if (!t)
+			return;
+		t->ramping = false;
+		if (level[channel])
+			arm_timer(t, (unsigned long) level[channel] * t->unit);
+		else
+			unlink_timer(t);
+#else
+		(void) channel;
+#endif
+	}
+
+	/// Return true if the given channel is a virtual channel
+	bool is_virtual(uint8_t channel) const
+	{
+#if RCN_HOST_MAX_VIRTUAL
+		for (size_t i = 0; i < num_virtual; i++)
+			if (virt[i].channel == channel)
+				return true;
+#else
+		(void) channel;
+#endif
+		return false;
+	}
+
+	/**
+	 * Recompute virtual channels whose inputs changed since last commit.
 	 *
-	 * As such, if the function wishes to reject the new value, it
-	 * merely returns 'old_level', while if it wishes to adopt the
-	 * new value, it should return 'new_level'. Otherwise, any return
-	 * value within 0 <= retval <= range is valid.
+	 * Inputs always have lower channel IDs than the virtual channels
+	 * derived from them, so visiting virtual channels in channel order
+	 * recomputes each of them at most once, after all of its inputs,
+	 * even when virtual channels are derived from other virtual channels.
 	 */
-	typedef uint8_t (*update_filter) (
-		uint8_t channel, // The channel id
-		uint8_t range, // The registered range for this channel
-		uint8_t data, // The auxiliary data for this channel
-		uint8_t old_level, // The old/current level
-		uint8_t new_level); // The proposed new level
+	void recompute()
+	{
+#if RCN_HOST_MAX_VIRTUAL
+		for (size_t i = 0; i < num_virtual; i++) {
+			uint8_t dirty = 0;
+			for (size_t j = 0; j < sizeof(changed); j++)
+				dirty |= changed[j] & virt[i].inputs[j];
+			if (dirty)
+				derive(virt + i);
+		}
+#endif
+	}
 
-private:
-	RCN_Node node;
-	update_filter handler;
-	size_t num_channels; // Number of active channels
-	uint8_t range[RCN_HOST_MAX_CHANNELS]; // channel ranges
-	uint8_t level[RCN_HOST_MAX_CHANNELS]; // channel levels
-	uint8_t data[RCN_HOST_MAX_CHANNELS]; // auxiliary channel data
+	/// Return true if set() should leave reporting to the channel policy
+	bool deferred(uint8_t channel)
+	{
+#if RCN_HOST_MAX_POLICIES
+		return find_policy(channel);
+#else
+		(void) channel;
+		return false;
+#endif
+	}
+
+	void mark_changed(uint8_t channel)
+	{
+		changed[channel / 8] |= 1 << (channel % 8);
+	}
+
+	/// Pass the new value through the filter, and store the result.
+	uint8_t apply(uint8_t channel, int value)
+	{
+		assert(channel < num_channels);
+		uint8_t l = handler(
+			channel,
+			range[channel],
+			data[channel],
+			level[channel],
+			LIMIT(0, value, range[channel])
+		);
+		if (l != level[channel]) {
+			level[channel] = l;
+			mark_changed(channel);
+			timer_changed(channel);
+		}
+		return l;
+	}
+
+	/// Invoke the commit hook, if there are any changes to commit.
+	void commit()
+	{
+		bool any = false;
+		for (size_t i = 0; i < sizeof(changed); i++)
+			any |= changed[i];
+		if (!any)
+			return;
+		if (commit_hook)
+			commit_hook(changed, level, num_channels);
+		memset(changed, 0, sizeof(changed));
+	}
+
+	/**
+	 * Update the timestamp of the given channel after a write stamped
+	 * 's' (NONE for local writes) that changed it from 'old_level'.
+	 *
+	 * A stamped write that was not overtaken lends its timestamp to the
+	 * channel. Other changes advance the timestamp once reported (see
+	 * report()), and not before, as a controller can only stamp its
+	 * requests with the timestamps it has seen.
+	 */
+	void restamp(uint8_t channel, uint8_t s, uint8_t old_level)
+	{
+		uint8_t bit = 1 << (channel % 8);
+		if (s != RCN_Stamp::NONE
+		    && !RCN_Stamp::overtaken(s, stamp[channel])) {
+			stamp[channel] = s;
+			unstamped[channel / 8] &= ~bit;
+		}
+		else if (level[channel] != old_level)
+			unstamped[channel / 8] |= bit;
+	}
+
+	/// Broadcast the current level of the given channel.
+	void report(uint8_t channel)
+	{
+		uint8_t bit = 1 << (channel % 8);
+		if (unstamped[channel / 8] & bit) {
+			unstamped[channel / 8] &= ~bit;
+			if (stamp[channel] != RCN_Stamp::NONE)
+				stamp[channel] = RCN_Stamp::next(
+					stamp[channel]);
+		}
+		node.send_status_update(
+			channel, level[channel], stamp[channel]);
+#if RCN_HOST_MAX_POLICIES
+		ReportPolicy *p = find_policy(channel);
+		if (p) {
+			p->reported = level[channel];
+			p->reported_at = millis();
+		}
+#endif
+	}
+
+	/// Report channels whose reporting policy says so.
+	void apply_policies()
+	{
+#if RCN_HOST_MAX_POLICIES
+		unsigned long now = millis();
+		for (size_t i = 0; i < num_policies; i++) {
+			ReportPolicy *p = policy + i;
+			uint8_t l = level[p->channel];
+			uint8_t diff = l > p->reported
+				? l - p->reported : p->reported - l;
+			unsigned long elapsed = now - p->reported_at;
+			bool changed = diff > p->deadband;
+			bool fast = false;
+			unsigned long window = now - p->window_at;
+			if (p->rate && window >= RCN_HOST_RATE_WINDOW) {
+				// Net change over the whole window, so that
+				// noise does not count as a high rate
+				uint8_t moved = l > p->window_level
+					? l - p->window_level
+					: p->window_level - l;
+				fast = 1000UL * moved
+					>= (unsigned long) p->rate * window;
+				p->window_level = l;
+				p->window_at = now;
+			}
+			if ((p->max_interval
+			     && elapsed >= 100UL * p->max_interval)
+			    || (changed && elapsed >= 100UL * p->min_interval)
+			    || (changed && fast))
+				report(p->channel);
+		}
+#endif
+	}
 
 public:
-	RCN_Host(uint8_t rf12_band, uint8_t rf12_group, uint8_t rf12_node,
-		update_filter handler)
+	RCN_HostBase(uint8_t rf12_band, uint8_t rf12_group, uint8_t rf12_node,
+		Filter handler)
 	: node(rf12_band, rf12_group, rf12_node),
 	  handler(handler),
-	  num_channels(0)
+	  num_channels(0),
+	  commit_hook(0),
+	  asleep(false)
+#if RCN_HOST_MAX_POLICIES
+	, num_policies(0)
+#endif
+#if RCN_HOST_MAX_VIRTUAL
+	, num_virtual(0)
+#endif
+#if RCN_HOST_MAX_TIMERS
+	, num_timers(0),
+	  tick(0),
+	  tick_at(0)
+#endif
 	{
+		static_assert(!RCN_HOST_RAM_BUDGET
+			|| sizeof(RCN_HostBase) <= RCN_HOST_RAM_BUDGET,
+			"RCN_HostBase exceeds RCN_HOST_RAM_BUDGET");
+		memset(unstamped, 0, sizeof(unstamped));
+		memset(changed, 0, sizeof(changed));
+#if RCN_HOST_MAX_TIMERS
+		memset(wheel, NO_TIMER, sizeof(wheel));
+#endif
 	}
 
 	void init()
@@ -59,14 +557,148 @@ public:
 
 	void add_channel(uint8_t r = 0xff, uint8_t l = 0, uint8_t d = 0)
 	{
-		assert(num_channels < RCN_HOST_MAX_CHANNELS);
+		assert(num_channels < MaxChannels);
 		size_t channel = num_channels++;
 		range[channel] = r;
 		level[channel] = l;
 		data[channel] = d;
+		stamp[channel] = RCN_Stamp::NONE;
+		mark_changed(channel);
 		set(channel, l);
 	}
 
+#if RCN_HOST_MAX_VIRTUAL
+	/**
+	 * Add a virtual channel (see RCN_DeriveFunc above).
+	 *
+	 * 'inputs' lists the 'num_inputs' channels that the new channel is
+	 * derived from, all of which must already have been added. Whenever
+	 * any of them changes, the virtual channel is recomputed from run(),
+	 * and the status updates of all channels changed in the same run()
+	 * go out together. Virtual channels are read-only: update requests
+	 * for them are answered with the current derived level.
+	 */
+	void add_virtual_channel(RCN_DeriveFunc func,
+		const uint8_t *inputs, size_t num_inputs,
+		uint8_t r = 0xff, uint8_t d = 0)
+	{
+		assert(num_channels < MaxChannels);
+		assert(num_virtual < RCN_HOST_MAX_VIRTUAL);
+		size_t channel = num_channels++;
+		range[channel] = r;
+		level[channel] = 0;
+		data[channel] = d;
+		stamp[channel] = RCN_Stamp::NONE;
+		mark_changed(channel);
+
+		VirtualChannel *v = virt + num_virtual++;
+		v->channel = channel;
+		v->derive = func;
+		memset(v->inputs, 0, sizeof(v->inputs));
+		for (size_t i = 0; i < num_inputs; i++) {
+			assert(inputs[i] < channel);
+			v->inputs[inputs[i] / 8] |= 1 << (inputs[i] % 8);
+		}
+		apply(channel, func(channel, r, d, level));
+		if (!deferred(channel))
+			report(channel);
+	}
+#endif
+
+#if RCN_HOST_MAX_TIMERS
+	/**
+	 * Add a timer channel, changing the 'target' channel when it expires.
+	 *
+	 * Setting the level of the timer channel to N > 0 (locally, or with
+	 * an update request from a controller) (re)arms the timer to expire
+	 * after N * 'unit_ms' milliseconds, while setting it to 0 cancels the
+	 * timer. On expiry, the timer channel drops back to 0, and 'target'
+	 * is set to 'fire_level', or, if 'step' is non-zero, ramped towards
+	 * it by 'step' every RCN_HOST_TICK_MS milliseconds. All of these
+	 * changes go through set(), and are hence broadcast as status
+	 * updates. E.g. a sleep timer turning off channel #0 after 1..255
+	 * minutes, fading out over ~5 seconds:
+	 *
+	 *   host.add_timer_channel(0, 0, 60000, 5);
+	 *
+	 * The host has no notion of wall-clock time, so daily schedules must
+	 * be (re)armed by a controller. Timers are serviced from run(), and
+	 * ticks missed while run() is not called are caught up on the next
+	 * call.
+	 */
+	void add_timer_channel(uint8_t target, uint8_t fire_level,
+		unsigned long unit_ms, uint8_t step = 0,
+		uint8_t r = 0xff, uint8_t d = 0)
+	{
+		assert(target < num_channels);
+		assert(num_timers < RCN_HOST_MAX_TIMERS);
+		assert(unit_ms >= RCN_HOST_TICK_MS
+		       && unit_ms / RCN_HOST_TICK_MS <= 0xffff);
+		if (!num_timers)
+			tick_at = millis();
+		Timer *t = timer + num_timers++;
+		t->channel = num_channels;
+		t->target = target;
+		t->fire_level = fire_level;
+		t->step = step;
+		t->unit = unit_ms / RCN_HOST_TICK_MS;
+		t->ramping = false;
+		t->slot = NO_TIMER;
+		add_channel(r, 0, d);
+	}
+#endif
+
+	/// Set the commit hook (see RCN_CommitHook above), or 0 for none.
+	void set_commit_hook(RCN_CommitHook hook)
+	{
+		commit_hook = hook;
+	}
+
+#if RCN_HOST_MAX_POLICIES
+	/**
+	 * Limit the status updates caused by set() on the given channel.
+	 *
+	 * This is meant for channels that expose measured values (e.g.
+	 * temperature or fader position), and that are set() from a sampling
+	 * loop. Instead of broadcasting a status update on every set(), run()
+	 * broadcasts one when:
+	 *
+	 *  - the level has changed by more than 'deadband' since it was last
+	 *    reported, and at least 'min_interval' has passed since then, or
+	 *  - the level has changed by more than 'deadband', and at a rate of
+	 *    at least 'rate' levels per second, as measured over the last
+	 *    RCN_HOST_RATE_WINDOW milliseconds (0 disables this trigger), or
+	 *  - 'max_interval' has passed since the level was last reported (0
+	 *    disables this trigger).
+	 *
+	 * Intervals are given in tenths of a second. The rate is checked once
+	 * per RCN_HOST_RATE_WINDOW, so it causes no more than one status
+	 * update per window, however noisy the input. Status updates in
+	 * reply to update requests from controllers are always sent
+	 * immediately.
+	 */
+	void set_report_policy(uint8_t channel, uint8_t deadband,
+		uint16_t min_interval, uint16_t max_interval,
+		uint8_t rate = 0)
+	{
+		assert(channel < num_channels);
+		ReportPolicy *p = find_policy(channel);
+		if (!p) {
+			assert(num_policies < RCN_HOST_MAX_POLICIES);
+			p = policy + num_policies++;
+			p->channel = channel;
+			p->reported = level[channel];
+			p->reported_at = millis();
+			p->window_level = level[channel];
+			p->window_at = millis();
+		}
+		p->deadband = deadband;
+		p->rate = rate;
+		p->min_interval = min_interval;
+		p->max_interval = max_interval;
+	}
+#endif
+
 	uint8_t get(uint8_t channel) const
 	{
 		assert(channel < num_channels);
@@ -75,61 +707,186 @@ public:
 
 	uint8_t set(uint8_t channel, int value)
 	{
-		assert(channel < num_channels);
-		level[channel] = handler(
-			channel,
-			range[channel],
-			data[channel],
-			level[channel],
-			LIMIT(0, value, range[channel])
-		);
-		node.send_status_update(channel, level[channel]);
+		RCN_PROFILE_SCOPE(RCN_PROF_HOST_SET);
+		uint8_t old_level = level[channel];
+		apply(channel, value);
+		restamp(channel, RCN_Stamp::NONE, old_level);
+		if (!deferred(channel))
+			report(channel);
 		return level[channel];
 	}
 
 	uint8_t adjust(uint8_t channel, int delta)
 	{
+		RCN_PROFILE_SCOPE(RCN_PROF_HOST_ADJUST);
 		int value = level[channel] + delta;
 		return set(channel, value);
 	}
 
+	/**
+	 * Turn off the radio
+	 *
+	 * This first broadcasts a sleep marker, telling any mailbox node
+	 * (see rcn_mailbox.h) to hold on to update requests for us. Returns
+	 * false until the marker and all other pending packets have been
+	 * sent, so keep calling run() and go_to_sleep() until it succeeds.
+	 */
+	bool go_to_sleep()
+	{
+		if (!asleep) {
+			node.send_sleep_marker(true);
+			asleep = true;
+		}
+		return node.go_to_sleep();
+	}
+
+	/**
+	 * Wake up from sleep
+	 *
+	 * This broadcasts a sleep marker, telling any mailbox node holding
+	 * update requests for us that we are now awake. Keep calling run()
+	 * for a while before going back to sleep, to receive them.
+	 */
+	void wake_up()
+	{
+		node.wake_up();
+		if (asleep) {
+			node.send_sleep_marker(false);
+			asleep = false;
+		}
+	}
+
 	/// Call this method often to keep things running smoothly.
 	void run(void)
 	{
-		RCN_Node::RecvPacket p;
-		if (!node.send_and_recv(p))
-			return;
-
-		if (p.channel() >= num_channels) {
-#ifdef DEBUG
-			LOG(F("Illegal channel number: "));
-			LOGln(p.channel());
+		RCN_PROFILE_SCOPE(RCN_PROF_HOST_RUN);
+		node.send_and_recv(*this);
+#if RCN_HOST_MAX_TIMERS
+		run_timers();
 #endif
+		recompute();
+		apply_policies();
+		commit();
+	}
+
+	/// Return the node's counters (see RCN_BasicNode::stats())
+	const RCN_Stats& stats() const
+	{
+		return node.stats();
+	}
+
+	void reset_stats()
+	{
+		node.reset_stats();
+	}
+
+	/// Write the node's event trace (see rcn_trace.h) to 'out'
+	template <class Out>
+	void dump_trace(Out& out) const
+	{
+		node.dump_trace(out);
+	}
+
+private:
+	template <uint8_t> friend class RCN_BasicNode;
+
+	bool valid_channel(uint8_t channel)
+	{
+		if (channel < num_channels)
+			return true;
+		node.debug(RCN_LOG_BAD_CHANNEL, channel);
+		return false;
+	}
+
+	/// Virtual channels are read-only; reply with their derived level
+	bool writable(uint8_t channel)
+	{
+		if (!is_virtual(channel))
+			return true;
+		report(channel);
+		return false;
+	}
+
+	void on_status_update(uint8_t, uint8_t, uint8_t, uint8_t)
+	{
+		// Status updates from other hosts are of no interest to us
+	}
+
+	void on_update_request_abs(uint8_t channel, uint8_t level, uint8_t s)
+	{
+		if (!valid_channel(channel) || !writable(channel))
+			return;
+		uint8_t old_level = get(channel);
+		if (RCN_Stamp::overtaken(s, stamp[channel])) {
+			// Overtaken in flight; tell the sender what won
+			report(channel);
 			return;
 		}
+		apply(channel, level);
+		restamp(channel, s, old_level);
+		report(channel);
+		node.debug(RCN_LOG_HOST_SET, channel, old_level, get(channel));
+	}
 
-#ifdef DEBUG
-		if (p.relative() && p.rel_level() == 0)
-			LOG(F("Status request for"));
-		else if (p.relative())
-			LOG(F("Adjusting"));
-		else
-			LOG(F("Setting"));
-		LOG(F(" channel #"));
-		LOG(p.channel());
-		LOG(F(": "));
-		LOG(get(p.channel()));
-		LOG(F(" + "));
-		LOG(p.relative() ? p.rel_level() : p.abs_level());
-		LOG(F(" => "));
-#endif
-		if (p.relative())
-			adjust(p.channel(), p.rel_level());
-		else
-			set(p.channel(), p.abs_level());
-#ifdef DEBUG
-		LOGln(get(p.channel()));
-#endif
+	void on_update_request_rel(uint8_t channel, int8_t adjustment,
+		uint8_t s)
+	{
+		if (!valid_channel(channel) || !writable(channel))
+			return;
+		// Adjustments commute, so they are applied regardless of age
+		uint8_t old_level = get(channel);
+		apply(channel, old_level + adjustment);
+		restamp(channel, s, old_level);
+		report(channel);
+		node.debug(RCN_LOG_HOST_ADJUST, channel, old_level,
+			get(channel));
+	}
+
+	void on_status_request(uint8_t channel, uint8_t s)
+	{
+		if (!valid_channel(channel))
+			return;
+		// A stamped SR may be a merge of adjustments summing to zero
+		restamp(channel, s, level[channel]);
+		// Answer straight from level[], without involving the filter
+		report(channel);
+		node.debug(RCN_LOG_HOST_STATUS, channel, level[channel]);
+	}
+};
+
+/// Host routing all channels through one update_filter function pointer
+class RCN_Host : public RCN_HostBase<RCN_UpdateFilter, RCN_HOST_MAX_CHANNELS>
+{
+public:
+	typedef RCN_UpdateFilter update_filter;
+
+	RCN_Host(uint8_t rf12_band, uint8_t rf12_group, uint8_t rf12_node,
+		update_filter handler)
+	: RCN_HostBase<update_filter, RCN_HOST_MAX_CHANNELS>(
+		rf12_band, rf12_group, rf12_node, handler)
+	{
+	}
+};
+
+/**
+ * Host with one compile-time handler type per channel
+ *
+ * The number of channels is given by the length of the handler list, and
+ * RCN_HOST_MAX_CHANNELS is not used. Usage:
+ *
+ *   RCN_StaticHost<Volume, Balance, Power> host(band, group, node);
+ */
+template <class... Handlers>
+class RCN_StaticHost : public RCN_HostBase<
+	RCN_Handlers<Handlers...>, sizeof...(Handlers)>
+{
+public:
+	RCN_StaticHost(uint8_t rf12_band, uint8_t rf12_group,
+		uint8_t rf12_node)
+	: RCN_HostBase<RCN_Handlers<Handlers...>, sizeof...(Handlers)>(
+		rf12_band, rf12_group, rf12_node,
+		RCN_Handlers<Handlers...>())
+	{
 	}
 };
 
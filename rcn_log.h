@@ -0,0 +1,114 @@
+/*
+ * Tokenized debug logging for the Remote Controller Network (RCN)
+ *
+ * Printing human-readable strings and hex dumps over a 57600 baud serial
+ * line from within the send/receive path takes milliseconds per packet,
+ * which changes the very timing being debugged. Instead, when DEBUG is
+ * enabled, each log point records a compact 4-byte entry (an event ID
+ * followed by up to three byte-sized arguments) into a small RAM ring
+ * buffer. The node writes these entries out in binary whenever it is
+ * idle, and they are turned back into text on the receiving computer.
+ *
+ * The event IDs and their format strings are listed exactly once, in
+ * RCN_LOG_EVENTS below. This header has no Arduino dependencies outside
+ * of the RCN_Log class, so a decoder may generate its string table by
+ * including this file and expanding the list:
+ *
+ *   #define RCN_LOG_STRING(id, fmt) fmt,
+ *   const char *rcn_log_strings[] = { RCN_LOG_EVENTS(RCN_LOG_STRING) };
+ *
+ * and then printf(rcn_log_strings[e[0]], e[1], e[2], e[3]) for every
+ * 4-byte entry 'e' read from the serial port.
+ *
+ * Author: Johan Herland <johan@herland.net>
+ * License: GNU GPL v2 or later
+ */
+
+#ifndef RCN_LOG_H
+#define RCN_LOG_H
+
+#include <stdint.h>
+
+#define RCN_LOG_EVENTS(X) \
+	X(INIT, "init: RCN v%u, using RFM12B group.node %u.%u\n") \
+	X(BAND, "init: band #%u (1: 433MHz, 2: 868MHz, 3: 915MHz)\n") \
+	X(SEND, "send: hdr 0x%02x, payload %02x %02x\n") \
+	X(RECV, "recv: hdr 0x%02x, payload %02x %02x\n") \
+	X(CRC_DROP, "recv: dropped packet with CRC mismatch\n") \
+	X(LEN_DROP, "recv: dropped packet from hdr 0x%02x with length %u\n") \
+	X(REL_DROP, "recv: dropped status update with relative level\n") \
+	X(OVERRUN, "send: overrunning send_buf!\n") \
+	X(BAD_CHANNEL, "illegal channel number: %u\n") \
+	X(HOST_SET, "host: setting channel #%u: %u => %u\n") \
+	X(HOST_ADJUST, "host: adjusting channel #%u: %u => %u\n") \
+	X(HOST_STATUS, "host: status request for channel #%u: %u\n") \
+	X(CTRL_UPDATE, "controller: status update for channel #%u: %u -> %u\n") \
+	X(LOST, "log: %u entries lost\n")
+
+#define RCN_LOG_ENUM(id, fmt) RCN_LOG_##id,
+enum { RCN_LOG_EVENTS(RCN_LOG_ENUM) RCN_LOG_NUM_EVENTS };
+#undef RCN_LOG_ENUM
+
+/// Number of entries in the log ring buffer (must be a power of two)
+#ifndef RCN_LOG_SIZE
+#define RCN_LOG_SIZE 32
+#endif
+
+/// Where to write log entries when flushing
+#ifndef RCN_LOG_OUTPUT
+#define RCN_LOG_OUTPUT Serial
+#endif
+
+class RCN_Log
+{
+private:
+	static_assert(!(RCN_LOG_SIZE & (RCN_LOG_SIZE - 1)),
+		"RCN_LOG_SIZE must be a power of two");
+	static const uint8_t ENTRY_SIZE = 4;
+
+	uint8_t buf[RCN_LOG_SIZE][ENTRY_SIZE]; // ring buffer
+	uint8_t head; // producer adds entries at this index
+	uint8_t tail; // consumer flushes entries from this index
+	uint8_t lost; // number of entries dropped since last flush
+
+public:
+	RCN_Log() : head(0), tail(0), lost(0) {}
+
+	/// Record an entry. Drops the entry if the ring buffer is full.
+	void put(uint8_t id, uint8_t a = 0, uint8_t b = 0, uint8_t c = 0)
+	{
+		uint8_t next = (head + 1) & (RCN_LOG_SIZE - 1);
+		if (next == tail) {
+			if (lost < 0xff)
+				lost++;
+			return;
+		}
+		uint8_t *e = buf[head];
+		e[0] = id;
+		e[1] = a;
+		e[2] = b;
+		e[3] = c;
+		head = next;
+	}
+
+	/**
+	 * Write out as many entries as 'out' can take without blocking.
+	 *
+	 * 'out' must provide availableForWrite() and write(buf, len), like
+	 * Arduino's HardwareSerial.
+	 */
+	template <class Out>
+	void flush(Out& out)
+	{
+		while (tail != head && out.availableForWrite() >= ENTRY_SIZE) {
+			out.write(buf[tail], ENTRY_SIZE);
+			tail = (tail + 1) & (RCN_LOG_SIZE - 1);
+		}
+		if (lost && tail == head) {
+			put(RCN_LOG_LOST, lost);
+			lost = 0;
+		}
+	}
+};
+
+#endif // RCN_LOG_H
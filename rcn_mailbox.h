@@ -0,0 +1,254 @@
+#ifndef RCN_MAILBOX_H
+#define RCN_MAILBOX_H
+
+#include <assert.h>
+
+#include <rcn_node.h>
+
+/// Set this to the max. number of sleepy hosts before #including me
+#ifndef RCN_MBOX_MAX_HOSTS
+#define RCN_MBOX_MAX_HOSTS 2
+#endif
+
+/// Set this to the max. number of pending updates before #including me
+#ifndef RCN_MBOX_MAX_ENTRIES
+#define RCN_MBOX_MAX_ENTRIES 8
+#endif
+
+/// Max. bytes of RAM used by RCN_Mailbox (0 = no limit)
+#ifndef RCN_MBOX_RAM_BUDGET
+#define RCN_MBOX_RAM_BUDGET 0
+#endif
+
+/// RCN_BasicNode features used by RCN_Mailbox (see rcn_node.h)
+#ifndef RCN_MBOX_NODE_FEATURES
+#define RCN_MBOX_NODE_FEATURES (RCN_TX_UR | RCN_RECV | RCN_STATS)
+#endif
+
+#define LIMIT(min, val, max) (min > val ? min : (max < val) ? max : val)
+
+/**
+ * Store-and-forward mailbox for sleeping hosts
+ *
+ * A battery-powered host that turns off its radio between polls (see
+ * RCN_Host::go_to_sleep()) misses every update request (UR) sent to it
+ * while asleep. A mains-powered node may run this mailbox, which listens
+ * in on all traffic in the netgroup, and holds on to URs sent to any of
+ * its registered hosts while they are asleep.
+ *
+ * Pending URs are kept per (host, channel), and are coalesced as they
+ * arrive: An absolute UR replaces whatever was pending for the channel,
+ * a relative UR is added to a pending absolute level, and consecutive
+ * relative URs are summed. Each entry keeps the newest logical timestamp
+ * (see rcn_node.h) of the URs coalesced into it.
+ *
+ * The mailbox relies on the sleep markers that RCN_Host broadcasts from
+ * go_to_sleep() and wake_up() (see rcn_node.h): URs are only stored
+ * between a host's "asleep" and "awake" markers, and when the "awake"
+ * marker arrives, all URs pending for the host are delivered together
+ * in one multi-record frame. Hosts are assumed to be awake until their
+ * first "asleep" marker.
+ *
+ * A host may still receive URs between sending its "asleep" marker and
+ * actually turning off its radio. A status update (SU) from a host that
+ * is marked as asleep shows that it is in fact still listening, and
+ * any UR pending for that channel is taken as already handled by the
+ * host, and discarded instead of being delivered again.
+ *
+ * To overhear URs addressed to other nodes, the mailbox uses the RFM12B
+ * catch-all node ID (31), so it cannot itself be addressed by any other
+ * node.
+ */
+class RCN_Mailbox
+{
+private:
+	static const uint8_t CATCH_ALL_NODE = 31;
+
+	class Host
+	{
+	public:
+		uint8_t id; // RFM12B node ID of sleepy host
+		bool asleep; // Set between "asleep" and "awake" markers
+	};
+
+	class Entry
+	{
+	public:
+		uint8_t host; // RFM12B node ID of destination host
+		uint8_t channel; // Channel ID at destination host
+		bool relative; // Relative (set) or absolute level
+		uint8_t level; // Absolute level, or relative (int8_t) adjust
+		uint8_t stamp; // Newest timestamp of coalesced URs
+	};
+
+	typedef RCN_BasicNode<RCN_MBOX_NODE_FEATURES> Node;
+
+	Node node;
+	size_t n_hosts; // Number of registered hosts
+	size_t n_entries; // Number of pending entries
+	Host hosts[RCN_MBOX_MAX_HOSTS];
+	Entry entries[RCN_MBOX_MAX_ENTRIES];
+
+	Host *find_host(uint8_t id)
+	{
+		for (size_t i = 0; i < n_hosts; i++)
+			if (hosts[i].id == id)
+				return hosts + i;
+		return 0;
+	}
+
+	Entry *find_entry(uint8_t host, uint8_t channel)
+	{
+		for (size_t i = 0; i < n_entries; i++)
+			if (entries[i].host == host
+			    && entries[i].channel == channel)
+				return entries + i;
+		return 0;
+	}
+
+	void remove_entry(Entry *e)
+	{
+		*e = entries[--n_entries];
+	}
+
+	/// Store (or coalesce) an UR for a sleeping host.
+	void store(uint8_t host, uint8_t channel, bool relative, uint8_t level,
+		uint8_t stamp)
+	{
+		Entry *e = find_entry(host, channel);
+		if (!e) {
+			if (n_entries >= RCN_MBOX_MAX_ENTRIES)
+				return; // Full; the controller will have to retry
+			e = entries + n_entries++;
+			e->host = host;
+			e->channel = channel;
+			e->relative = relative;
+			e->level = level;
+			e->stamp = stamp;
+		}
+		else if (RCN_Stamp::overtaken(stamp, e->stamp) && !relative)
+			return; // Overtaken by a newer write
+		else if (!relative) {
+			e->relative = false;
+			e->level = level;
+		}
+		else if (!e->relative) {
+			int l = e->level + (int8_t) level;
+			e->level = LIMIT(0, l, 0xff);
+		}
+		else {
+			int adjust = (int8_t) e->level + (int8_t) level;
+			e->level = (int8_t) LIMIT(-128, adjust, 127);
+		}
+		e->stamp = RCN_Stamp::adopt(e->stamp, stamp);
+	}
+
+	/// Send all URs pending for the given host.
+	void deliver(uint8_t host)
+	{
+		for (size_t i = 0; i < n_entries; ) {
+			Entry *e = entries + i;
+			if (e->host != host) {
+				i++;
+				continue;
+			}
+			if (e->relative)
+				node.send_update_request_rel(
+					host, e->channel, e->level, e->stamp);
+			else
+				node.send_update_request_abs(
+					host, e->channel, e->level, e->stamp);
+			remove_entry(e);
+		}
+	}
+
+public:
+	RCN_Mailbox(uint8_t rf12_band, uint8_t rf12_group)
+	: node(rf12_band, rf12_group, CATCH_ALL_NODE),
+	  n_hosts(0),
+	  n_entries(0)
+	{
+		static_assert(!RCN_MBOX_RAM_BUDGET
+			|| sizeof(RCN_Mailbox) <= RCN_MBOX_RAM_BUDGET,
+			"RCN_Mailbox exceeds RCN_MBOX_RAM_BUDGET");
+	}
+
+	void init()
+	{
+		node.init();
+	}
+
+	/// Hold URs for the given host while it is asleep.
+	void add_host(uint8_t id)
+	{
+		assert(n_hosts < RCN_MBOX_MAX_HOSTS);
+		Host *h = hosts + n_hosts++;
+		h->id = id;
+		h->asleep = false;
+	}
+
+	/// Call this method often to keep things running smoothly.
+	void run(void)
+	{
+		Node::RecvPacket p;
+		if (!node.send_and_recv(p))
+			return;
+
+		Host *h = find_host(p.node());
+		if (!h)
+			return;
+
+		if (!p.bcast()) {
+			if (!h->asleep)
+				return; // The host receives this itself
+			for (uint8_t i = 0; i < p.records(); i++)
+				store(h->id, p.channel(i), p.relative(i),
+					p.abs_level(i), p.stamp(i));
+			return;
+		}
+
+		// Sleep markers and status updates from a registered host
+		for (uint8_t i = 0; i < p.records(); i++) {
+			if (p.marker(i)) {
+				if (p.abs_level(i) == RCN_MARK_ASLEEP)
+					h->asleep = true;
+				else if (p.abs_level(i) == RCN_MARK_AWAKE
+					 && h->asleep) {
+					h->asleep = false;
+					deliver(h->id);
+				}
+				continue;
+			}
+			if (p.relative(i))
+				continue; // Invalid relative broadcast
+			Entry *e = find_entry(h->id, p.channel(i));
+			if (e && h->asleep)
+				remove_entry(e); // Handled by the host itself
+		}
+	}
+
+	/*
+	 * See RCN_Controller::stats(). Needs RCN_STATS in
+	 * RCN_MBOX_NODE_FEATURES.
+	 */
+	template <class N = Node>
+	const RCN_Stats& stats() const
+	{
+		return static_cast<const N&>(node).stats();
+	}
+
+	template <class N = Node>
+	void reset_stats()
+	{
+		static_cast<N&>(node).reset_stats();
+	}
+
+	/// Write the node's event trace (see rcn_trace.h) to 'out'
+	template <class Out>
+	void dump_trace(Out& out) const
+	{
+		node.dump_trace(out);
+	}
+};
+
+#endif // RCN_MAILBOX_H
@@ -132,6 +132,9 @@
  *   - Byte #2:
  *     - Level value: Absolute (0..255) or relative (-128..127)
  *
+ * (This layout is encoded in rcn_protocol.h, which is shared with any
+ * non-Arduino code that needs to speak the RCN protocol.)
+ *
  * To summarize, the packet payload looks like this for the various
  * message types:
  *
@@ -155,6 +158,64 @@
  *     - Channel ID: $channel for which the current Level is reported
  *     - Level value: $abs_value (The current value of the Level)
  *
+ *   - Sleep marker (broadcast from Host)
+ *     - Relative flag: Set
+ *     - Channel ID: 0
+ *     - Level value: RCN_MARK_ASLEEP (1) when the Host is about to turn
+ *       off its radio, or RCN_MARK_AWAKE (2) when it has turned it back
+ *       on. These tell a mailbox node (see rcn_mailbox.h) when to hold
+ *       on to URs for the Host, and when to deliver them. Other nodes
+ *       ignore them (as nodes running RCN v1/v2 ignore any relative
+ *       broadcast).
+ *
+ * Multi-record frames
+ * -------------------
+ *
+ * Since RCN v2, a packet may carry several of the above 2-byte payloads
+ * ("records") back to back, all sharing the same HDR byte. In other
+ * words, a single broadcast may carry status updates for several
+ * Channels, and a single directed message may carry update requests for
+ * several Channels at the same Host. Receivers process the records in
+ * order, exactly as if they had arrived in separate packets. Senders
+ * combine queued packets with the same HDR into one frame, up to
+ * RCN_MAX_RECORDS records, and may hold packets back for a short while
+ * (RCN_BATCH_WINDOW) to combine more of them. (Nodes running RCN v1 drop
+ * any packet longer than 2 bytes.)
+ *
+ * Logical timestamps
+ * ------------------
+ *
+ * When several Controllers adjust the same Channel at the same time,
+ * each of them will see the other's SUs arrive while their own URs are
+ * in flight, and their cached Levels will oscillate. To avoid this, URs
+ * and SUs may carry a small logical timestamp (1..255, wrapping around;
+ * 0 means no timestamp). Since RCN v3, a packet with an odd length is a
+ * "stamped frame", where each record is followed by its own 1-byte
+ * timestamp, and one 0 byte is appended if needed to make the length
+ * odd (i.e. a stamped frame with N records is 3 * N bytes long if N is
+ * odd, and 3 * N + 1 bytes if N is even). Senders use a stamped frame
+ * if any of its records has a timestamp. Records with and without
+ * timestamps may thus share a frame.
+ *
+ *  - A Controller stamps its URs with the timestamp following the newest
+ *    one it has seen from the Host, and remembers this timestamp per
+ *    Channel, until an SU that has not been overtaken by it arrives, or
+ *    until the Host fails to reply in time. SUs overtaken by the
+ *    Controller's own pending UR are ignored. SRs are stamped with the
+ *    newest timestamp seen, so that the reply is never overtaken by the
+ *    Controller's own pending URs.
+ *  - A Host keeps a timestamp per Channel: that of the last stamped UR
+ *    or SR it accepted, advanced by one whenever a local (or unstamped)
+ *    change to the Channel is reported, so that Controllers learn of it.
+ *    It drops absolute URs overtaken by this timestamp (but still
+ *    replies with an SU), adopts the timestamps of all other URs and
+ *    SRs, and echoes the Channel's timestamp in every SU.
+ *
+ * A timestamp is only overtaken by one that is a few steps ahead of it
+ * (see RCN_Stamp in rcn_protocol.h), so a Controller that has fallen far
+ * behind (e.g. while asleep) is not locked out. Records without a
+ * timestamp are always accepted.
+ *
  * Author: Johan Herland <johan@herland.net>
  * License: GNU GPL v2 or later
  */
@@ -164,81 +225,294 @@
 
 #include <Arduino.h>
 
+#include <rcn_log.h>
+#include <rcn_profile.h>
+#include <rcn_protocol.h>
+#include <rcn_trace.h>
+
 #ifndef RF12_h
 #error You must #include <RF12.h> before #including this file
 #endif
 
-#ifndef LOG
-#define LOG(...)
-// Alternative for logging to serial port:
-// #define LOG Serial.print
+const unsigned int RCN_VERSION = 3;
+
+/// Level values of sleep markers (see above)
+enum { RCN_MARK_ASLEEP = 1, RCN_MARK_AWAKE = 2 };
+
+/// Max. number of records combined into one frame (see above)
+#ifndef RCN_MAX_RECORDS
+#define RCN_MAX_RECORDS 8
+#endif
+
+/*
+ * Max. number of milliseconds to hold back queued packets, in order to
+ * combine more of them into each frame (0 = send at once). Packets are
+ * only held back while the radio is busy, i.e. when a frame was sent
+ * less than RCN_BATCH_WINDOW ms ago, and never once enough of them are
+ * queued to fill a frame. Hence, at low load, this adds no latency.
+ */
+#ifndef RCN_BATCH_WINDOW
+#define RCN_BATCH_WINDOW 0
+#endif
+
+/// Number of packets that can be queued for sending (2..255)
+#ifndef RCN_SEND_BUF_SIZE
+#define RCN_SEND_BUF_SIZE 16
 #endif
 
-const unsigned int RCN_VERSION = 1;
+/**
+ * Optional node features
+ *
+ * Not every node needs every part of RCN_Node: a host never sends URs,
+ * a controller never sends SUs, and few nodes look at their stats. The
+ * features are selected at compile time by RCN_BasicNode's template
+ * argument, and code for the features left out is compiled away, or
+ * fails to compile (with a static_assert) if it is used anyway:
+ *
+ *  - RCN_TX_SU: send_status_update(), and dispatch of received URs to
+ *    the visitor (only a node sending SUs has any use for URs),
+ *  - RCN_TX_UR: send_update_request_*() and send_status_request(), and
+ *    dispatch of received SUs to the visitor,
+ *  - RCN_RECV: receiving packets at all,
+ *  - RCN_SLEEP: go_to_sleep() and wake_up(),
+ *  - RCN_STATS: stats() and reset_stats(), and the counters behind them.
+ *
+ * The host, controller and mailbox classes pick the features they need
+ * by default; #define RCN_HOST_NODE_FEATURES, RCN_CTRL_NODE_FEATURES,
+ * RCN_PAGED_NODE_FEATURES or RCN_MBOX_NODE_FEATURES before #including
+ * them to add more (e.g. RCN_STATS) or to leave some out.
+ *
+ * Use e.g. "avr-size -C" on builds of the example sketches to compare
+ * the footprint of the different feature sets.
+ */
+enum {
+	RCN_TX_SU = 1 << 0,
+	RCN_TX_UR = 1 << 1,
+	RCN_RECV = 1 << 2,
+	RCN_SLEEP = 1 << 3,
+	RCN_STATS = 1 << 4,
+	RCN_ALL_FEATURES = 0x1f,
+};
 
-class RCN_Node
+/// Running counts of network activity, see RCN_BasicNode::stats()
+class RCN_Stats
 {
-private:
-	class Payload
+public:
+	uint16_t sent; // Packets handed to the radio
+	uint16_t received; // Valid packets received
+	uint16_t crc_drops; // Packets dropped on CRC mismatch
+	uint16_t len_drops; // Packets dropped on unexpected length
+	uint16_t overruns; // Packets lost to send buffer overrun
+};
+
+/// Storage for RCN_Stats, or nothing if RCN_STATS is disabled
+template <bool Enabled>
+class RCN_Counters
+{
+public:
+	RCN_Stats stats;
+
+	RCN_Counters() : stats() {}
+	void count(uint16_t RCN_Stats::*counter, uint16_t n = 1)
 	{
-	public:
-		uint8_t channel  : 7; // Channel ID
-		uint8_t relative : 1; // Relative (set) or absolute level
-		union {
-			uint8_t abs_level;
-			int8_t  rel_level;
-		};
-	};
+		stats.*counter += n;
+	}
+	void reset() { stats = RCN_Stats(); }
+};
+
+template <>
+class RCN_Counters<false>
+{
+public:
+	void count(uint16_t RCN_Stats::*, uint16_t = 1) {}
+	void reset() {}
+};
 
+template <uint8_t Features>
+class RCN_BasicNode
+{
+public:
+	typedef RCN_Stats Stats;
+
+private:
 	class Packet
 	{
 	public:
 		uint8_t hdr; // RFM12B packer header
-		union {
-			Payload d;
-			uint8_t b[sizeof(Payload)];
-		};
+		uint8_t b[RCN_Payload::size]; // Encoded payload
+		uint8_t stamp; // Logical timestamp, or RCN_Stamp::NONE
 	};
 
-	static const uint8_t SEND_BUF_SIZE = 16;
+	static const uint8_t SEND_BUF_SIZE = RCN_SEND_BUF_SIZE;
+	static_assert(RCN_SEND_BUF_SIZE >= 2 && RCN_SEND_BUF_SIZE <= 255,
+		"RCN_SEND_BUF_SIZE must be within 2..255");
+	static const uint8_t MAX_FRAME = // Longest (stamped) frame we send
+		RCN_MAX_RECORDS * RCN_Stamp::record_size + 1;
+	static_assert(MAX_FRAME <= RF12_MAXDATA,
+		"RCN_MAX_RECORDS records do not fit in one RFM12B packet");
 	Packet send_buf[SEND_BUF_SIZE]; // ring buffer
 	uint8_t send_buf_next; // producer adds packets at this index
 	uint8_t send_buf_done; // consumer reads packets from this index
 	uint8_t rf12_band; // RF12_433MHZ, RF12_868MHZ or RF12_915MHZ
 	uint8_t rf12_group; // Netgroup (1..212 for RFM12B, 212 for RFM12)
 	uint8_t rf12_node; // ID of this node (1..30)
+#if DEBUG
+	RCN_Log log_buf; // Pending debug log entries (see rcn_log.h)
+#endif
+	RCN_Trace trace_buf; // Recent events (see rcn_trace.h)
+	RCN_Counters<(Features & RCN_STATS) != 0> counters;
+#if RCN_BATCH_WINDOW
+	unsigned long sent_at; // millis() at last frame sent
+	unsigned long queued_at; // millis() when oldest packet was queued
+#endif
+
+	/// Return the number of packets waiting in send_buf
+	uint8_t queued() const
+	{
+		return (send_buf_next + SEND_BUF_SIZE - send_buf_done)
+			% SEND_BUF_SIZE;
+	}
 
 	Packet *prepare_packet()
 	{
+		RCN_PROFILE_SCOPE(RCN_PROF_PREPARE_PACKET);
 		Packet *p = send_buf + send_buf_next;
+#if RCN_BATCH_WINDOW
+		if (send_buf_next == send_buf_done)
+			queued_at = millis();
+#endif
 		// Advance producer index to next index w/wrap-around.
 		++send_buf_next %= SEND_BUF_SIZE;
 		// We should never overtake the consumer index.
-		if (send_buf_next == send_buf_done)
-			LOG(F("Oops! Overrunning send_buf!\n"));
+		if (send_buf_next == send_buf_done) {
+			counters.count(&Stats::overruns, SEND_BUF_SIZE);
+			trace_buf.put(RCN_TRACE_OVERRUN, SEND_BUF_SIZE);
+			debug(RCN_LOG_OVERRUN);
+		}
+		else
+			trace_buf.put(RCN_TRACE_ENQUEUE, queued());
 		return p;
 	}
 
-#if DEBUG
-	static void print_bytes(const volatile uint8_t *buf, size_t len)
+	/// Like prepare_packet(), but queue the packet ahead of all others
+	Packet *prepare_urgent_packet()
 	{
-		for (size_t i = 0; i < len; i++) {
-			LOG(F(" "));
-			if (buf[i] <= 0xf)
-				LOG(F("0"));
-			LOG(buf[i], HEX);
+		if (send_buf_next == send_buf_done
+		    || queued() == SEND_BUF_SIZE - 1)
+			return prepare_packet();
+		send_buf_done = (send_buf_done + SEND_BUF_SIZE - 1)
+			% SEND_BUF_SIZE;
+		trace_buf.put(RCN_TRACE_ENQUEUE, queued());
+		return send_buf + send_buf_done;
+	}
+
+	/**
+	 * Return the last queued packet with the given header and channel,
+	 * if any. There may be more than one (e.g. two relative URs whose
+	 * sum overflows), and new data must only be merged into the last
+	 * one, or it would be sent (and applied) before the others.
+	 */
+	Packet *find_queued(uint8_t hdr, uint8_t channel)
+	{
+		Packet *found = 0;
+		for (uint8_t i = send_buf_done; i != send_buf_next;
+		     i = (i + 1) % SEND_BUF_SIZE) {
+			Packet *p = send_buf + i;
+			// Sleep markers are never merged
+			if (!(hdr & RF12_HDR_DST)
+			    && RCN_Payload::relative(p->b))
+				continue;
+			if (p->hdr == hdr
+			    && RCN_Payload::channel(p->b) == channel)
+				found = p;
 		}
-		LOG(F("\n"));
+		return found;
 	}
+
+	/// Return true if queued packets should be sent now, not batched
+	bool batch_ready() const
+	{
+#if RCN_BATCH_WINDOW
+		unsigned long now = millis();
+		return now - sent_at >= RCN_BATCH_WINDOW
+			|| now - queued_at >= RCN_BATCH_WINDOW
+			|| queued() >= RCN_MAX_RECORDS
+			|| queued() >= SEND_BUF_SIZE / 2;
+#else
+		return true;
 #endif
+	}
+
+	/**
+	 * Move the first queued packet into 'frame' (of MAX_FRAME bytes),
+	 * along with all other queued packets with the same header (up to
+	 * RCN_MAX_RECORDS in total), and return the frame length. The
+	 * packets left behind are moved up in send_buf, keeping their order.
+	 */
+	uint8_t take_frame(uint8_t *frame)
+	{
+		// Lay out the records as a stamped frame
+		const uint8_t w = RCN_Stamp::record_size;
+		uint8_t hdr = send_buf[send_buf_done].hdr;
+		uint8_t n = 0;
+		bool stamped = false;
+		uint8_t keep = send_buf_done;
+		for (uint8_t i = send_buf_done; i != send_buf_next;
+		     i = (i + 1) % SEND_BUF_SIZE) {
+			Packet *p = send_buf + i;
+			if (p->hdr == hdr && n < RCN_MAX_RECORDS) {
+				memcpy(frame + n * w, p->b, sizeof(p->b));
+				frame[n * w + sizeof(p->b)] = p->stamp;
+				stamped |= p->stamp != RCN_Stamp::NONE;
+				n++;
+				continue;
+			}
+			if (keep != i)
+				send_buf[keep] = *p;
+			keep = (keep + 1) % SEND_BUF_SIZE;
+		}
+		send_buf_next = keep;
+
+		if (stamped) {
+			if (n % 2 == 0)
+				frame[n * w] = 0; // Padding to odd length
+			return n * w + (n % 2 == 0);
+		}
+		// No timestamps; drop them from the frame
+		for (uint8_t i = 0; i < n; i++)
+			memmove(frame + i * RCN_Payload::size, frame + i * w,
+				RCN_Payload::size);
+		return n * RCN_Payload::size;
+	}
+
+	/// Return the queued UR for the given host and channel, if any
+	Packet *queued_request(uint8_t host, uint8_t channel)
+	{
+		return find_queued(RF12_HDR_DST | (RF12_HDR_MASK & host),
+			channel);
+	}
+
+	/// Queue a new (as yet empty) UR for the given host
+	Packet *new_request(uint8_t host)
+	{
+		Packet *p = prepare_packet();
+		p->hdr = RF12_HDR_DST | (RF12_HDR_MASK & host);
+		p->stamp = RCN_Stamp::NONE;
+		return p;
+	}
 
 public:
-	RCN_Node(uint8_t rf12_band, uint8_t rf12_group, uint8_t rf12_node)
+	RCN_BasicNode(uint8_t rf12_band, uint8_t rf12_group,
+		uint8_t rf12_node)
 	: send_buf_next(0),
 	  send_buf_done(0),
 	  rf12_band(rf12_band),
 	  rf12_group(rf12_group),
 	  rf12_node(rf12_node)
+#if RCN_BATCH_WINDOW
+	, sent_at(0),
+	  queued_at(0)
+#endif
 	{
 	}
 
@@ -246,53 +520,132 @@ public:
 	{
 		rf12_initialize(rf12_node, rf12_band, rf12_group);
 
-		LOG(F("Initializing RCN v"));
-		LOG(RCN_VERSION);
-		LOG(F(", using RFM12B group.node "));
-		LOG(rf12_group);
-		LOG(F("."));
-		LOG(rf12_node);
-		LOG(F(" @ "));
-		LOG(rf12_band == RF12_868MHZ ? 868
-		 : (rf12_band == RF12_433MHZ ? 433 : 915));
-		LOG(F("MHz\n"));
+		debug(RCN_LOG_INIT, RCN_VERSION, rf12_group, rf12_node);
+		debug(RCN_LOG_BAND, rf12_band);
 	}
 
-	void send_status_update(uint8_t channel, uint8_t level)
+	/**
+	 * Return the counters of network activity since the last reset.
+	 *
+	 * The counters wrap around at 2^16, so whoever collects them should
+	 * do so regularly, and compute differences modulo 2^16.
+	 */
+	const Stats& stats() const
 	{
-		// Prepare broadcast packet with given data
-		Packet *p = prepare_packet();
-		p->hdr = RF12_HDR_MASK & rf12_node;
-		p->d.relative = 0;
-		p->d.channel = channel;
-		p->d.abs_level = level;
+		static_assert(Features & RCN_STATS, "RCN_STATS is disabled");
+		return counters.stats;
+	}
+
+	void reset_stats()
+	{
+		static_assert(Features & RCN_STATS, "RCN_STATS is disabled");
+		counters.reset();
+	}
+
+	/// Write the event trace (see rcn_trace.h) to 'out', e.g. Serial.
+	template <class Out>
+	void dump_trace(Out& out) const
+	{
+		trace_buf.dump(out);
+	}
+
+	/**
+	 * Record a debug log entry (see rcn_log.h for the event IDs).
+	 *
+	 * This is a no-op unless DEBUG is enabled. The entry is written out
+	 * later, from send_and_recv(), once the node is idle.
+	 */
+	void debug(uint8_t id, uint8_t a = 0, uint8_t b = 0, uint8_t c = 0)
+	{
+#if DEBUG
+		log_buf.put(id, a, b, c);
+#else
+		(void) id; (void) a; (void) b; (void) c;
+#endif
+	}
+
+	void send_status_update(uint8_t channel, uint8_t level,
+		uint8_t stamp = RCN_Stamp::NONE)
+	{
+		static_assert(Features & RCN_TX_SU, "RCN_TX_SU is disabled");
+		// Prepare broadcast packet with given data. If a status
+		// update for this channel is already waiting to be sent,
+		// update that one instead, as only the latest level matters.
+		uint8_t hdr = RF12_HDR_MASK & rf12_node;
+		Packet *p = find_queued(hdr, channel);
+		if (!p) {
+			p = prepare_packet();
+			p->hdr = hdr;
+		}
+		RCN_Payload::encode(p->b, channel, false, level);
+		p->stamp = stamp;
 	}
 
 	void send_update_request_abs(
-		uint8_t host, uint8_t channel, uint8_t level)
+		uint8_t host, uint8_t channel, uint8_t level,
+		uint8_t stamp = RCN_Stamp::NONE)
 	{
-		// Prepare directed packet with given data
-		Packet *p = prepare_packet();
-		p->hdr = RF12_HDR_DST | (RF12_HDR_MASK & host);
-		p->d.relative = 0;
-		p->d.channel = channel;
-		p->d.abs_level = level;
+		static_assert(Features & RCN_TX_UR, "RCN_TX_UR is disabled");
+		// Prepare directed packet with given data. An absolute UR
+		// overrides any UR for the same channel that is still
+		// waiting to be sent.
+		Packet *p = queued_request(host, channel);
+		if (!p)
+			p = new_request(host);
+		RCN_Payload::encode(p->b, channel, false, level);
+		p->stamp = RCN_Stamp::adopt(p->stamp, stamp);
 	}
 
 	void send_update_request_rel(
-		uint8_t host, uint8_t channel, int8_t adjust)
+		uint8_t host, uint8_t channel, int8_t adjust,
+		uint8_t stamp = RCN_Stamp::NONE)
 	{
-		// Prepare directed packet with given data
-		Packet *p = prepare_packet();
-		p->hdr = RF12_HDR_DST | (RF12_HDR_MASK & host);
-		p->d.relative = 1;
-		p->d.channel = channel;
-		p->d.rel_level = adjust;
+		static_assert(Features & RCN_TX_UR, "RCN_TX_UR is disabled");
+		// Prepare directed packet with given data. If an UR for
+		// the same channel is still waiting to be sent, fold the
+		// adjustment into it instead (the reply to that UR also
+		// answers a status request).
+		Packet *p = queued_request(host, channel);
+		bool relative = true;
+		int l = adjust;
+		if (p && !RCN_Payload::relative(p->b)) {
+			relative = false;
+			l += RCN_Payload::abs_level(p->b);
+			l = l < 0 ? 0 : l > 0xff ? 0xff : l;
+		}
+		else if (p) {
+			int sum = l + RCN_Payload::rel_level(p->b);
+			if (sum < -128 || sum > 127)
+				p = 0; // Cannot merge; send both
+			else
+				l = sum;
+		}
+		if (!p)
+			p = new_request(host);
+		RCN_Payload::encode(p->b, channel, relative, l);
+		p->stamp = RCN_Stamp::adopt(p->stamp, stamp);
 	}
 
-	void send_status_request(uint8_t host, uint8_t channel)
+	/**
+	 * Broadcast a sleep marker (see above).
+	 *
+	 * The marker is queued ahead of any other packets, so that an awake
+	 * marker precedes the SUs queued while the radio was off.
+	 */
+	void send_sleep_marker(bool asleep)
 	{
-		send_update_request_rel(host, channel, 0);
+		static_assert(Features & RCN_TX_SU, "RCN_TX_SU is disabled");
+		Packet *p = prepare_urgent_packet();
+		p->hdr = RF12_HDR_MASK & rf12_node;
+		p->stamp = RCN_Stamp::NONE;
+		RCN_Payload::encode(p->b, 0, true,
+			asleep ? RCN_MARK_ASLEEP : RCN_MARK_AWAKE);
+	}
+
+	void send_status_request(uint8_t host, uint8_t channel,
+		uint8_t stamp = RCN_Stamp::NONE)
+	{
+		send_update_request_rel(host, channel, 0, stamp);
 	}
 
 	bool sending() const
@@ -302,83 +655,193 @@ public:
 
 	bool go_to_sleep()
 	{
+		static_assert(Features & RCN_SLEEP, "RCN_SLEEP is disabled");
 		if (sending())
 			return false;
 		rf12_sleep(RF12_SLEEP); // Turn off RFM12B radio
+		trace_buf.put(RCN_TRACE_SLEEP);
 		return true;
 	}
 
 	void wake_up()
 	{
+		static_assert(Features & RCN_SLEEP, "RCN_SLEEP is disabled");
 		rf12_sleep(RF12_WAKEUP); // Turn on RFM12B radio
+		trace_buf.put(RCN_TRACE_WAKE);
 	}
 
+	/**
+	 * Non-owning view of a received packet
+	 *
+	 * This refers directly into the RFM12B driver's receive buffer, and
+	 * is only valid until the next call to send_and_recv(). The payload
+	 * bytes are decoded on access, using the schema in rcn_protocol.h.
+	 * The packet holds records() records (see "Multi-record frames"
+	 * above), which are accessed by passing their index.
+	 */
 	class RecvPacket
 	{
 	private:
-		friend class RCN_Node;
-		Payload d; // Copy of rf12_data
-		uint8_t h; // Copy of rf12_hdr
+		friend class RCN_BasicNode;
+		const volatile uint8_t *d; // Points into rf12_data
+		uint8_t h; // rf12_hdr
+		uint8_t n; // Number of records
+		uint8_t w; // Bytes per record (larger in stamped frames)
 
-		void copy(uint8_t hdr, const volatile uint8_t *data)
+		const volatile uint8_t *rec(uint8_t i) const
 		{
-			h = hdr;
-			d = *(struct Payload *)data;
+			return d + i * w;
 		}
+
 	public:
+		RecvPacket() : d(0), h(0), n(0), w(RCN_Payload::size) {}
+
 		bool bcast() const { return !(h & RF12_HDR_DST); }
 		uint8_t node() const { return h & RF12_HDR_MASK; }
-		uint8_t channel() const { return d.channel; }
-		bool relative() const { return d.relative; }
-		uint8_t abs_level() const { return d.abs_level; }
-		int8_t rel_level() const { return d.rel_level; }
+		uint8_t records() const { return n; }
+		/// Return true if record #i is a sleep marker (see above)
+		bool marker(uint8_t i = 0) const
+		{
+			return bcast() && relative(i) && channel(i) == 0
+				&& (abs_level(i) == RCN_MARK_ASLEEP
+				    || abs_level(i) == RCN_MARK_AWAKE);
+		}
+		uint8_t stamp(uint8_t i = 0) const
+		{
+			if (w != RCN_Stamp::record_size)
+				return RCN_Stamp::NONE;
+			return rec(i)[RCN_Payload::size];
+		}
+		uint8_t channel(uint8_t i = 0) const
+		{
+			return RCN_Payload::channel(rec(i));
+		}
+		bool relative(uint8_t i = 0) const
+		{
+			return RCN_Payload::relative(rec(i));
+		}
+		uint8_t abs_level(uint8_t i = 0) const
+		{
+			return RCN_Payload::abs_level(rec(i));
+		}
+		int8_t rel_level(uint8_t i = 0) const
+		{
+			return RCN_Payload::rel_level(rec(i));
+		}
 	};
 
 	/// Call this method often to keep things running smoothly.
 	bool send_and_recv(RecvPacket& recvd)
 	{
-		if (send_buf_next != send_buf_done && rf12_canSend()) {
+		RCN_PROFILE_SCOPE(RCN_PROF_SEND_AND_RECV);
+		// Check batch_ready() first, as rf12_canSend() stops the
+		// receiver whenever it returns true
+		if (send_buf_next != send_buf_done && batch_ready()
+		    && rf12_canSend()) {
 			// We have packets to send, and we can send them.
-			Packet * p = send_buf + send_buf_done;
-			++send_buf_done %= SEND_BUF_SIZE;
-			rf12_sendStart(p->hdr, p->b, sizeof(p->b));
-
-#if DEBUG
-			LOG(F("send_and_recv(): Sending "));
-			if (p->hdr & RF12_HDR_DST)
-				LOG(F("message to node "));
-			else
-				LOG(F("broadcast from node "));
-			LOG(p->hdr & RF12_HDR_MASK);
-			LOG(": ");
-			print_bytes(p->b, sizeof(p->b));
+			// Combine packets for the same destination into one
+			// multi-record frame.
+			uint8_t frame[MAX_FRAME];
+			uint8_t hdr = send_buf[send_buf_done].hdr;
+			uint8_t len = take_frame(frame);
+#if RCN_BATCH_WINDOW
+			sent_at = millis();
 #endif
+			trace_buf.put(RCN_TRACE_TX_START, queued());
+			counters.count(&Stats::sent);
+			rf12_sendStart(hdr, frame, len);
+			debug(RCN_LOG_SEND, hdr, frame[0], frame[1]);
 		}
 
-		if (rf12_recvDone()) {
+		if ((Features & RCN_RECV) && rf12_recvDone()) {
 			if (rf12_crc) {
-#if DEBUG
-				LOG(F("send_and_recv(): Dropping packet "
-					"with CRC mismatch!\n"));
-#endif
+				trace_buf.put(RCN_TRACE_CRC_DROP, rf12_len);
+				counters.count(&Stats::crc_drops);
+				debug(RCN_LOG_CRC_DROP);
 				return false;
 			}
-#if DEBUG
-			LOG(F("send_and_recv(): Received "));
-			LOG((rf12_hdr & RF12_HDR_DST)
-				? F("message") : F("broadcast"));
-			LOG(F(" from node "));
-			LOG(rf12_hdr & RF12_HDR_MASK);
-			LOG(": ");
-			print_bytes(rf12_data, rf12_len);
-#endif
-			if (rf12_len != sizeof(Payload))
+			trace_buf.put(RCN_TRACE_RECV, rf12_hdr);
+			// Stamped frames have an odd length (see above)
+			uint8_t w = RCN_Payload::size;
+			if (rf12_len % 2)
+				w = RCN_Stamp::record_size;
+			uint8_t n = rf12_len / w;
+			if (!n || rf12_len - n * w > 1) {
+				counters.count(&Stats::len_drops);
+				debug(RCN_LOG_LEN_DROP, rf12_hdr, rf12_len);
 				return false;
-			recvd.copy(rf12_hdr, rf12_data);
+			}
+			debug(RCN_LOG_RECV, rf12_hdr, rf12_data[0], rf12_data[1]);
+			counters.count(&Stats::received);
+			recvd.h = rf12_hdr;
+			recvd.d = rf12_data;
+			recvd.n = n;
+			recvd.w = w;
 			return true;
 		}
+#if DEBUG
+		// Don't use sending() here: rf12_canSend() stops the receiver
+		if (send_buf_next == send_buf_done)
+			log_buf.flush(RCN_LOG_OUTPUT);
+#endif
 		return false;
 	}
+
+	/**
+	 * Like the above, but dispatch each record of the received packet to
+	 * the matching method of the given visitor:
+	 *
+	 *  - on_status_update(uint8_t host, uint8_t channel, uint8_t level,
+	 *    uint8_t stamp) for SU broadcasts,
+	 *  - on_update_request_abs(uint8_t channel, uint8_t level,
+	 *    uint8_t stamp) for absolute URs directed at this node,
+	 *  - on_update_request_rel(uint8_t channel, int8_t adjust,
+	 *    uint8_t stamp) for relative URs directed at this node, and
+	 *  - on_status_request(uint8_t channel, uint8_t stamp) for status
+	 *    requests (i.e. relative URs with zero adjustment) directed at
+	 *    this node.
+	 *
+	 * 'stamp' is the record's logical timestamp, or RCN_Stamp::NONE.
+	 *
+	 * Returns true iff a packet was dispatched.
+	 */
+	template <class Visitor>
+	bool send_and_recv(Visitor& v)
+	{
+		RecvPacket p;
+		if (!send_and_recv(p))
+			return false;
+
+		// SUs are only of interest to nodes sending URs, and vice versa
+		if (p.bcast() ? !(Features & RCN_TX_UR)
+			      : !(Features & RCN_TX_SU))
+			return true;
+
+		for (uint8_t i = 0; i < p.records(); i++) {
+			if (p.bcast()) {
+				if (p.relative(i)) {
+					// Sleep markers are for mailboxes only
+					if (!p.marker(i))
+						debug(RCN_LOG_REL_DROP);
+					continue;
+				}
+				v.on_status_update(p.node(), p.channel(i),
+					p.abs_level(i), p.stamp(i));
+			}
+			else if (p.relative(i) && p.rel_level(i) == 0)
+				v.on_status_request(p.channel(i), p.stamp(i));
+			else if (p.relative(i))
+				v.on_update_request_rel(p.channel(i),
+					p.rel_level(i), p.stamp(i));
+			else
+				v.on_update_request_abs(p.channel(i),
+					p.abs_level(i), p.stamp(i));
+		}
+		return true;
+	}
 };
 
+/// A node with all features enabled
+typedef RCN_BasicNode<RCN_ALL_FEATURES> RCN_Node;
+
 #endif // RCN_NODE_H
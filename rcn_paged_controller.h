@@ -0,0 +1,365 @@
+#ifndef RCN_PAGED_CONTROLLER_H
+#define RCN_PAGED_CONTROLLER_H
+
+#include <assert.h>
+
+#include <rcn_node.h>
+
+/// Set this to the number of channels to keep in RAM before #including me
+#ifndef RCN_PAGED_SLOTS
+#define RCN_PAGED_SLOTS 8
+#endif
+
+/// Minimum number of milliseconds between batches of notifications
+#ifndef RCN_PAGED_NOTIFY_INTERVAL
+#define RCN_PAGED_NOTIFY_INTERVAL 0
+#endif
+
+/// Max. bytes of RAM used by RCN_PagedController (0 = no limit)
+#ifndef RCN_PAGED_RAM_BUDGET
+#define RCN_PAGED_RAM_BUDGET 0
+#endif
+
+/// RCN_BasicNode features used by RCN_PagedController (see rcn_node.h)
+#ifndef RCN_PAGED_NODE_FEATURES
+#define RCN_PAGED_NODE_FEATURES (RCN_TX_UR | RCN_RECV | RCN_SLEEP | RCN_STATS)
+#endif
+
+#define LIMIT(min, val, max) (min > val ? min : (max < val) ? max : val)
+
+/// Static description of one channel, kept in flash (PROGMEM)
+struct RCN_ChannelInfo
+{
+	uint8_t host; // RFM12B node ID of the host owning the channel
+	uint8_t channel; // Channel ID at that host
+	uint8_t range; // The range of the channel
+	uint8_t data; // Auxiliary data for the channel
+};
+
+/**
+ * Controller for more channels than fit in RAM
+ *
+ * RCN_Controller keeps range, level and data for every channel in RAM,
+ * and talks to a single host. This controller instead takes a table of
+ * RCN_ChannelInfo in flash, which may list any number of channels (up to
+ * 255) spread over any number of hosts, and only keeps the levels of the
+ * RCN_PAGED_SLOTS most recently used channels in RAM.
+ *
+ * Channels are identified by their index into the table. When a channel
+ * that is not in RAM is accessed, the least recently used channel is
+ * evicted, and the level of the new channel is requested from its host.
+ * Until the host replies, the channel's level is reported as 0. Status
+ * updates for channels not in RAM are ignored. Call show() whenever a new
+ * page of channels becomes visible, to fetch all their levels up front.
+ */
+class RCN_PagedController
+{
+public:
+	/*
+	 * Same as RCN_Controller::update_notifier (including the batched
+	 * delivery from run(), here at most once every
+	 * RCN_PAGED_NOTIFY_INTERVAL milliseconds), except that 'channel' is
+	 * the index into the channel table, and that it is only invoked for
+	 * channels currently held in RAM. Pending notifications for a
+	 * channel are dropped when it is evicted.
+	 */
+	typedef void (*update_notifier) (
+		uint8_t channel, // The channel index
+		uint8_t range, // The registered range for this channel
+		uint8_t data, // The auxiliary data for this channel
+		uint8_t old_level, // The old/previous level
+		uint8_t new_level); // The new/current level
+
+	/*
+	 * Same as RCN_Controller::batch_notifier, except that the channels
+	 * updated in the batch are listed by their index into the channel
+	 * table, along with their old and new levels.
+	 */
+	typedef void (*batch_notifier) (
+		const uint8_t *channel, // Indexes of the updated channels
+		const uint8_t *old_level, // Their old/previous levels
+		const uint8_t *new_level, // Their new/current levels
+		uint8_t count); // Number of updated channels
+
+private:
+	static const uint8_t NONE = 0xff; // Marks an unused slot
+	static_assert(RCN_PAGED_SLOTS < NONE, "Too many RCN_PAGED_SLOTS");
+
+	typedef RCN_BasicNode<RCN_PAGED_NODE_FEATURES> Node;
+
+	Node node;
+	update_notifier notifier;
+	batch_notifier batch_hook;
+	const RCN_ChannelInfo *table; // channel table in PROGMEM
+	uint8_t n_channels; // Number of entries in table
+	uint8_t slot_index[RCN_PAGED_SLOTS]; // table index held by slot
+	uint8_t slot_host[RCN_PAGED_SLOTS]; // copy of table host
+	uint8_t slot_channel[RCN_PAGED_SLOTS]; // copy of table channel
+	uint8_t slot_level[RCN_PAGED_SLOTS]; // cached channel level
+	uint8_t slot_notified[RCN_PAGED_SLOTS]; // last notified level
+	uint8_t slot_used[RCN_PAGED_SLOTS]; // 'clock' at last access
+	uint8_t clock; // Incremented on every slot access
+	uint8_t dirty[(RCN_PAGED_SLOTS + 7) / 8]; // pending notify per slot
+	unsigned long last_notify; // millis() at last notification batch
+
+	/// Mark the given slot as the most recently used one.
+	void touch(uint8_t slot)
+	{
+		if (clock == 0xff) {
+			// Renumber the slots 1..RCN_PAGED_SLOTS in LRU order
+			// before 'clock' wraps around.
+			uint8_t rank[RCN_PAGED_SLOTS];
+			for (uint8_t s = 0; s < RCN_PAGED_SLOTS; s++) {
+				rank[s] = 1;
+				for (uint8_t t = 0; t < RCN_PAGED_SLOTS; t++)
+					if (slot_used[t] < slot_used[s])
+						rank[s]++;
+			}
+			memcpy(slot_used, rank, sizeof(slot_used));
+			clock = RCN_PAGED_SLOTS;
+		}
+		slot_used[slot] = ++clock;
+	}
+
+	RCN_ChannelInfo info(uint8_t index) const
+	{
+		RCN_ChannelInfo ci;
+		memcpy_P(&ci, table + index, sizeof(ci));
+		return ci;
+	}
+
+	/// Return the slot holding the given channel, fetching it if needed.
+	uint8_t load(uint8_t index)
+	{
+		assert(index < n_channels);
+		uint8_t victim = 0;
+		for (uint8_t s = 0; s < RCN_PAGED_SLOTS; s++) {
+			if (slot_index[s] == index) {
+				touch(s);
+				return s;
+			}
+			if (slot_index[s] == NONE
+			    || (slot_index[victim] != NONE
+			        && slot_used[s] < slot_used[victim]))
+				victim = s;
+		}
+
+		RCN_ChannelInfo ci = info(index);
+		slot_index[victim] = index;
+		slot_host[victim] = ci.host;
+		slot_channel[victim] = ci.channel;
+		slot_level[victim] = 0;
+		slot_notified[victim] = 0;
+		dirty[victim / 8] &= ~(1 << (victim % 8));
+		touch(victim);
+		node.send_status_request(ci.host, ci.channel);
+		return victim;
+	}
+
+	/// Update the cached level of the given slot.
+	uint8_t update(uint8_t slot, int value)
+	{
+		RCN_ChannelInfo ci = info(slot_index[slot]);
+		uint8_t v = LIMIT(0, value, ci.range);
+		slot_level[slot] = v;
+		dirty[slot / 8] |= 1 << (slot % 8);
+		return v;
+	}
+
+	/// Deliver pending notifications, unless we did so too recently.
+	void notify()
+	{
+		unsigned long now = millis();
+#if RCN_PAGED_NOTIFY_INTERVAL
+		if (now - last_notify < RCN_PAGED_NOTIFY_INTERVAL)
+			return;
+#endif
+
+		uint8_t index[RCN_PAGED_SLOTS];
+		uint8_t old_level[RCN_PAGED_SLOTS];
+		uint8_t new_level[RCN_PAGED_SLOTS];
+		uint8_t n = 0;
+		for (uint8_t s = 0; s < RCN_PAGED_SLOTS; s++) {
+			uint8_t bit = 1 << (s % 8);
+			if (!(dirty[s / 8] & bit))
+				continue;
+			dirty[s / 8] &= ~bit;
+			index[n] = slot_index[s];
+			old_level[n] = slot_notified[s];
+			new_level[n++] = slot_level[s];
+			slot_notified[s] = slot_level[s];
+		}
+		if (!n)
+			return;
+
+		for (uint8_t i = 0; notifier && i < n; i++) {
+			RCN_ChannelInfo ci = info(index[i]);
+			notifier(index[i], ci.range, ci.data,
+				 old_level[i], new_level[i]);
+		}
+		if (batch_hook)
+			batch_hook(index, old_level, new_level, n);
+		last_notify = now;
+	}
+
+public:
+	RCN_PagedController(
+		uint8_t rf12_band, uint8_t rf12_group, uint8_t rf12_node,
+		const RCN_ChannelInfo *table, uint8_t n_channels,
+		update_notifier notifier)
+	: node(rf12_band, rf12_group, rf12_node),
+	  notifier(notifier),
+	  batch_hook(0),
+	  table(table),
+	  n_channels(n_channels),
+	  clock(0),
+	  last_notify(0)
+	{
+		static_assert(!RCN_PAGED_RAM_BUDGET
+			|| sizeof(RCN_PagedController) <= RCN_PAGED_RAM_BUDGET,
+			"RCN_PagedController exceeds RCN_PAGED_RAM_BUDGET");
+		assert(n_channels < NONE);
+		memset(slot_index, NONE, sizeof(slot_index));
+		memset(slot_used, 0, sizeof(slot_used));
+		memset(dirty, 0, sizeof(dirty));
+	}
+
+	void init()
+	{
+		node.init();
+	}
+
+	size_t num_channels() const
+	{
+		return n_channels;
+	}
+
+	/// Set the batch notifier (see batch_notifier above), or 0 for none.
+	void set_batch_notifier(batch_notifier n)
+	{
+		batch_hook = n;
+	}
+
+	/**
+	 * Call this when channels first..first+count-1 become visible.
+	 *
+	 * This brings all of them into RAM, and requests status updates for
+	 * those that were not already there. 'count' must not be larger than
+	 * RCN_PAGED_SLOTS.
+	 */
+	void show(uint8_t first, uint8_t count)
+	{
+		assert(count <= RCN_PAGED_SLOTS);
+		for (uint8_t i = 0; i < count; i++)
+			load(first + i);
+	}
+
+	uint8_t get(uint8_t channel)
+	{
+		return slot_level[load(channel)];
+	}
+
+	/// Call this to request a status update from the remote host.
+	void sync(uint8_t channel)
+	{
+		uint8_t s = load(channel);
+		node.send_status_request(slot_host[s], slot_channel[s]);
+	}
+
+	/// Call this to change the absolute level of the given channel.
+	uint8_t set(uint8_t channel, int value)
+	{
+		uint8_t s = load(channel);
+		uint8_t ret = update(s, value);
+		node.send_update_request_abs(
+			slot_host[s], slot_channel[s], ret);
+		return ret;
+	}
+
+	/// Call this to relatively adjust the level of the given channel.
+	uint8_t adjust(uint8_t channel, int delta)
+	{
+		uint8_t s = load(channel);
+		int8_t d = LIMIT(-128, delta, 127);
+		uint8_t ret = update(s, slot_level[s] + delta);
+		if (d)
+			node.send_update_request_rel(
+				slot_host[s], slot_channel[s], d);
+		return ret;
+	}
+
+	/// Call this method often to keep things running smoothly.
+	void run(void)
+	{
+		node.send_and_recv(*this);
+		notify();
+	}
+
+	/*
+	 * See RCN_Controller::stats(). Needs RCN_STATS in
+	 * RCN_PAGED_NODE_FEATURES.
+	 */
+	template <class N = Node>
+	const RCN_Stats& stats() const
+	{
+		return static_cast<const N&>(node).stats();
+	}
+
+	template <class N = Node>
+	void reset_stats()
+	{
+		static_cast<N&>(node).reset_stats();
+	}
+
+	/// Write the node's event trace (see rcn_trace.h) to 'out'
+	template <class Out>
+	void dump_trace(Out& out) const
+	{
+		node.dump_trace(out);
+	}
+
+	/// See RCN_Controller::go_to_sleep() and wake_up()
+	template <class N = Node>
+	bool go_to_sleep()
+	{
+		return static_cast<N&>(node).go_to_sleep();
+	}
+
+	template <class N = Node>
+	void wake_up()
+	{
+		static_cast<N&>(node).wake_up();
+	}
+
+private:
+	template <uint8_t> friend class RCN_BasicNode;
+
+	void on_status_update(uint8_t host, uint8_t channel, uint8_t level,
+		uint8_t)
+	{
+		for (uint8_t s = 0; s < RCN_PAGED_SLOTS; s++) {
+			if (slot_index[s] != NONE && slot_host[s] == host
+			    && slot_channel[s] == channel) {
+				update(s, level);
+				return;
+			}
+		}
+	}
+
+	void on_update_request_abs(uint8_t, uint8_t, uint8_t)
+	{
+		// Update requests are only meant for hosts
+	}
+
+	void on_update_request_rel(uint8_t, int8_t, uint8_t)
+	{
+		// Update requests are only meant for hosts
+	}
+
+	void on_status_request(uint8_t, uint8_t)
+	{
+		// Status requests are only meant for hosts
+	}
+};
+
+#endif // RCN_PAGED_CONTROLLER_H
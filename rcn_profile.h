@@ -0,0 +1,60 @@
+/*
+ * Profiling probes for the Remote Controller Network (RCN)
+ *
+ * Benchmarks run on a regular computer say little about how many ATmega
+ * cycles the RCN code actually takes. Instead, the main RCN API calls are
+ * marked with RCN_PROFILE_SCOPE(id), which by default expands to nothing.
+ *
+ * When RCN_PROFILE is defined before #including the RCN headers, entering
+ * a marked call writes its ID (one of the RCN_PROF_* constants below) to
+ * the GPIOR1 register, and leaving it writes the same ID to GPIOR2. Each
+ * probe is a single 'out' instruction. An AVR emulator (e.g. simavr with
+ * a simulated RFM12B) can hook writes to these registers, and use its
+ * cycle counter and the emulated stack pointer to report cycles and stack
+ * depth per call. Calls may nest (e.g. RCN_PROF_HOST_RUN contains
+ * RCN_PROF_SEND_AND_RECV), so the harness should keep a stack of open IDs.
+ *
+ * Author: Johan Herland <johan@herland.net>
+ * License: GNU GPL v2 or later
+ */
+
+#ifndef RCN_PROFILE_H
+#define RCN_PROFILE_H
+
+#include <stdint.h>
+
+enum {
+	RCN_PROF_PREPARE_PACKET = 1,
+	RCN_PROF_SEND_AND_RECV,
+	RCN_PROF_HOST_RUN,
+	RCN_PROF_HOST_SET,
+	RCN_PROF_HOST_ADJUST,
+	RCN_PROF_CTRL_RUN,
+	RCN_PROF_CTRL_UPDATE,
+	RCN_PROF_CTRL_SET,
+	RCN_PROF_CTRL_ADJUST,
+};
+
+#ifdef RCN_PROFILE
+
+#include <avr/io.h>
+
+class RCN_ProfileScope
+{
+private:
+	const uint8_t id;
+
+public:
+	RCN_ProfileScope(uint8_t id) : id(id) { GPIOR1 = id; }
+	~RCN_ProfileScope() { GPIOR2 = id; }
+};
+
+#define RCN_PROFILE_SCOPE(id) RCN_ProfileScope rcn_profile_scope_(id)
+
+#else
+
+#define RCN_PROFILE_SCOPE(id) do {} while (0)
+
+#endif // RCN_PROFILE
+
+#endif // RCN_PROFILE_H
@@ -0,0 +1,142 @@
+/*
+ * Wire format of the Remote Controller Network (RCN) packet payload
+ *
+ * This is the one place where the payload layout described in rcn_node.h
+ * is encoded. It depends on nothing but <stdint.h>, so that the exact
+ * same encoders and decoders can be used by the AVR firmware and by code
+ * talking to the RCN from a regular computer (e.g. a Linux gateway behind
+ * a JeeLink), regardless of compiler.
+ *
+ * Each field is described by its byte offset, bit offset and width, and
+ * is accessed with explicit shifts and masks. Unlike bitfields, this does
+ * not depend on the compiler's choice of bit order, and it compiles down
+ * to the same (branch-free) instructions on AVR.
+ *
+ * Author: Johan Herland <johan@herland.net>
+ * License: GNU GPL v2 or later
+ */
+
+#ifndef RCN_PROTOCOL_H
+#define RCN_PROTOCOL_H
+
+#include <stdint.h>
+
+/// A field of 'Bits' bits, starting at bit 'Shift' of byte 'Byte'
+template <uint8_t Byte, uint8_t Shift, uint8_t Bits>
+class RCN_Field
+{
+public:
+	static_assert(Bits > 0 && Shift + Bits <= 8,
+		"RCN_Field must fit within a single byte");
+
+	static const uint8_t byte = Byte;
+	static const uint8_t mask = ((1u << Bits) - 1) << Shift;
+
+	/// Extract this field from the given payload
+	static uint8_t get(const volatile uint8_t *b)
+	{
+		return (b[Byte] & mask) >> Shift;
+	}
+
+	/// Return 'v' shifted and masked into position within its byte
+	static uint8_t pack(uint8_t v)
+	{
+		return (v << Shift) & mask;
+	}
+};
+
+/// Payload schema: one Channel ID, a relative flag and a Level value
+class RCN_Payload
+{
+public:
+	typedef RCN_Field<0, 0, 7> Channel; // Channel ID (0..127)
+	typedef RCN_Field<0, 7, 1> Relative; // Relative (set) or absolute
+	typedef RCN_Field<1, 0, 8> Level; // Absolute or relative level
+
+	static const uint8_t size = 2; // Number of bytes on the wire
+
+	static_assert(Channel::byte < size && Relative::byte < size
+		&& Level::byte < size, "Field outside of payload");
+	static_assert(Channel::byte != Relative::byte
+		|| !(Channel::mask & Relative::mask), "Overlapping fields");
+	static_assert(Channel::byte != Level::byte
+		|| !(Channel::mask & Level::mask), "Overlapping fields");
+	static_assert(Relative::byte != Level::byte
+		|| !(Relative::mask & Level::mask), "Overlapping fields");
+
+	static void encode(uint8_t *b,
+		uint8_t channel, bool relative, uint8_t level)
+	{
+		for (uint8_t i = 0; i < size; i++)
+			b[i] = 0;
+		b[Channel::byte] |= Channel::pack(channel);
+		b[Relative::byte] |= Relative::pack(relative);
+		b[Level::byte] |= Level::pack(level);
+	}
+
+	static uint8_t channel(const volatile uint8_t *b)
+	{
+		return Channel::get(b);
+	}
+
+	static bool relative(const volatile uint8_t *b)
+	{
+		return Relative::get(b);
+	}
+
+	static uint8_t abs_level(const volatile uint8_t *b)
+	{
+		return Level::get(b);
+	}
+
+	static int8_t rel_level(const volatile uint8_t *b)
+	{
+		return (int8_t) Level::get(b);
+	}
+};
+
+/**
+ * Logical timestamps (see "Logical timestamps" in rcn_node.h)
+ *
+ * Timestamps wrap around, and a node may fall arbitrarily far behind
+ * (e.g. while asleep), so two timestamps cannot simply be ordered.
+ * Instead, a timestamp is only overtaken by those that are at most
+ * 'window' steps ahead of it, i.e. by the few writes that can happen
+ * while a packet is in flight. Timestamps further apart are unrelated.
+ * The value 0 means "no timestamp", and is never overtaken, nor does it
+ * overtake any other timestamp.
+ */
+class RCN_Stamp
+{
+public:
+	static const uint8_t NONE = 0;
+
+	/// Max. number of steps by which a timestamp may be overtaken
+	static const uint8_t window = 8;
+
+	/// Bytes per record in a stamped frame: the payload, then the stamp
+	static const uint8_t record_size = RCN_Payload::size + 1;
+
+	/// Return the timestamp following 's', skipping NONE
+	static uint8_t next(uint8_t s)
+	{
+		return s == 0xff ? 1 : s + 1;
+	}
+
+	/// Return true iff both are timestamps, and 'a' was overtaken by 'b'
+	static bool overtaken(uint8_t a, uint8_t b)
+	{
+		uint8_t d = b - a;
+		return a != NONE && b != NONE && d && d <= window;
+	}
+
+	/// Return the timestamp to keep when 's' arrives after 'cur'
+	static uint8_t adopt(uint8_t cur, uint8_t s)
+	{
+		if (s == NONE || overtaken(s, cur))
+			return cur;
+		return s;
+	}
+};
+
+#endif // RCN_PROTOCOL_H
@@ -0,0 +1,111 @@
+/*
+ * Always-on event trace for the Remote Controller Network (RCN)
+ *
+ * When a node misbehaves in the field, there is usually no debug build
+ * attached to it. RCN_Node therefore keeps a small, fixed-size ring of
+ * the most recent timestamped events (packets enqueued, transmissions
+ * started, packets received or dropped, send buffer overruns, and radio
+ * sleep/wake-up), which can be dumped on demand for post-mortem timing
+ * analysis. Recording an event costs a timestamp read and four stores.
+ *
+ * Each entry is 4 bytes:
+ *
+ *  - Timestamp: 16 bits, little-endian, in units of 64us (i.e. micros()
+ *    >> 6), so it wraps around every ~4.2 seconds. Compute differences
+ *    between consecutive entries modulo 2^16 to build a timeline.
+ *  - Event ID: One of the RCN_TRACE_* constants below.
+ *  - Argument: Event-specific byte; see below.
+ *
+ * A dump consists of a 4-byte header: 'R', 'T', RCN_TRACE_SIZE, and the
+ * number of entries that follow, followed by those entries, oldest first.
+ *
+ * Set RCN_TRACE_SIZE to 0 before #including rcn_node.h to disable the
+ * trace completely.
+ *
+ * Author: Johan Herland <johan@herland.net>
+ * License: GNU GPL v2 or later
+ */
+
+#ifndef RCN_TRACE_H
+#define RCN_TRACE_H
+
+#include <Arduino.h>
+
+/// Number of entries kept in the trace ring (must be a power of two)
+#ifndef RCN_TRACE_SIZE
+#define RCN_TRACE_SIZE 16
+#endif
+
+enum {
+	RCN_TRACE_ENQUEUE, // Packet queued; arg: #packets queued
+	RCN_TRACE_TX_START, // Transmission started; arg: #packets queued
+	RCN_TRACE_RECV, // Packet received; arg: RFM12B header
+	RCN_TRACE_CRC_DROP, // Packet dropped on CRC mismatch; arg: length
+	RCN_TRACE_OVERRUN, // Send buffer overrun; arg: #packets queued
+	RCN_TRACE_SLEEP, // Radio turned off
+	RCN_TRACE_WAKE, // Radio turned on
+};
+
+class RCN_Trace
+{
+private:
+	static_assert(!(RCN_TRACE_SIZE & (RCN_TRACE_SIZE - 1))
+		&& RCN_TRACE_SIZE <= 128,
+		"RCN_TRACE_SIZE must be a power of two, at most 128");
+	static const uint8_t ENTRY_SIZE = 4;
+
+#if RCN_TRACE_SIZE
+	uint8_t buf[RCN_TRACE_SIZE][ENTRY_SIZE]; // ring buffer
+	uint8_t head; // next entry is written at this index
+	bool wrapped; // set once the ring has been filled
+#endif
+
+public:
+#if RCN_TRACE_SIZE
+	RCN_Trace() : head(0), wrapped(false) {}
+#endif
+
+	/// Record an event, overwriting the oldest entry if necessary.
+	void put(uint8_t event, uint8_t arg = 0)
+	{
+#if RCN_TRACE_SIZE
+		uint16_t t = micros() >> 6;
+		uint8_t *e = buf[head];
+		e[0] = t;
+		e[1] = t >> 8;
+		e[2] = event;
+		e[3] = arg;
+		head = (head + 1) & (RCN_TRACE_SIZE - 1);
+		if (!head)
+			wrapped = true;
+#else
+		(void) event; (void) arg;
+#endif
+	}
+
+	/**
+	 * Write the trace to 'out', oldest entry first.
+	 *
+	 * 'out' must provide write(buf, len), like Arduino's Print class.
+	 * This is meant to be called on demand, and will block until the
+	 * whole trace has been handed to 'out'.
+	 */
+	template <class Out>
+	void dump(Out& out) const
+	{
+#if RCN_TRACE_SIZE
+		uint8_t count = wrapped ? RCN_TRACE_SIZE : head;
+		uint8_t first = wrapped ? head : 0;
+		const uint8_t hdr[] = { 'R', 'T', RCN_TRACE_SIZE, count };
+		out.write(hdr, sizeof(hdr));
+		for (uint8_t i = 0; i < count; i++)
+			out.write(buf[(first + i) & (RCN_TRACE_SIZE - 1)],
+				ENTRY_SIZE);
+#else
+		const uint8_t hdr[] = { 'R', 'T', 0, 0 };
+		out.write(hdr, sizeof(hdr));
+#endif
+	}
+};
+
+#endif // RCN_TRACE_H
@@ -0,0 +1,40 @@
+/*
+ * Minimal stand-in for the Arduino core, for the host-compiled tests
+ *
+ * Only what the RCN headers use is declared here. The definitions live
+ * in rcn_mock_net.h.
+ *
+ * Author: Johan Herland <johan@herland.net>
+ * License: GNU GPL v2 or later
+ */
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef uint8_t byte;
+
+#define HEX 16
+#define F(s) (s)
+#define PROGMEM
+#define memcpy_P memcpy
+
+unsigned long millis();
+unsigned long micros();
+
+class MockSerial
+{
+public:
+	size_t write(uint8_t) { return 1; }
+	size_t write(const uint8_t *, size_t n) { return n; }
+	int availableForWrite() { return 64; }
+	template <class T> void print(T) {}
+	template <class T> void print(T, int) {}
+};
+
+extern MockSerial Serial;
+
+#endif // Arduino_h
@@ -0,0 +1,45 @@
+/*
+ * Minimal stand-in for JeeLib's RF12 driver, for the host-compiled tests
+ *
+ * Only what the RCN headers use is declared here. The definitions live
+ * in rcn_mock_net.h.
+ *
+ * Author: Johan Herland <johan@herland.net>
+ * License: GNU GPL v2 or later
+ */
+
+#ifndef RF12_h
+#define RF12_h
+
+#include <stdint.h>
+
+#define RF12_433MHZ 1
+#define RF12_868MHZ 2
+#define RF12_915MHZ 3
+
+#define RF12_HDR_CTL 0x80
+#define RF12_HDR_DST 0x40
+#define RF12_HDR_ACK 0x20
+#define RF12_HDR_MASK 0x1F
+
+#define RF12_MAXDATA 66
+
+#define RF12_SLEEP 0
+#define RF12_WAKEUP -1
+
+extern volatile uint16_t rf12_crc;
+extern volatile uint8_t rf12_buf[];
+
+#define rf12_grp rf12_buf[0]
+#define rf12_hdr rf12_buf[1]
+#define rf12_len rf12_buf[2]
+#define rf12_data (rf12_buf + 3)
+
+uint8_t rf12_initialize(uint8_t id, uint8_t band, uint8_t group = 0xd4,
+	uint16_t frequency = 1600);
+uint8_t rf12_recvDone();
+uint8_t rf12_canSend();
+void rf12_sendStart(uint8_t hdr, const void *ptr, uint8_t len);
+char rf12_sleep(char n);
+
+#endif // RF12_h
@@ -0,0 +1,198 @@
+/*
+ * A simulated RFM12B network, for host-compiled scenario tests
+ *
+ * Defines the functions and variables declared by mock/Arduino.h and
+ * mock/RF12.h. Since the RF12 driver is a singleton, every node taking
+ * part in a test registers a function running its run() method, and
+ * the network switches between them, delivering each frame sent to all
+ * other (awake) nodes, or to its destination only. Time only advances
+ * when the test says so, or while pumping the network.
+ *
+ * Include this once, from the test's .cpp file, after the RCN headers.
+ *
+ * Author: Johan Herland <johan@herland.net>
+ * License: GNU GPL v2 or later
+ */
+
+#ifndef RCN_MOCK_NET_H
+#define RCN_MOCK_NET_H
+
+#include <stdio.h>
+
+#include <Arduino.h>
+#include <RF12.h>
+
+MockSerial Serial;
+volatile uint16_t rf12_crc;
+volatile uint8_t rf12_buf[RF12_MAXDATA + 5];
+
+typedef void (*mock_run_func)();
+
+static const uint8_t MOCK_MAX_NODES = RF12_HDR_MASK + 1;
+static const size_t MOCK_MAX_AIR = 64;
+
+class MockFrame
+{
+public:
+	uint8_t from; // ID of the sending node
+	uint8_t hdr; // RFM12B packet header
+	uint8_t len; // Number of bytes in data
+	uint8_t data[RF12_MAXDATA];
+};
+
+static unsigned long mock_now; // millis()
+static mock_run_func mock_nodes[MOCK_MAX_NODES]; // run() per node ID
+static bool mock_asleep[MOCK_MAX_NODES]; // Receives nothing while set
+static uint8_t mock_me; // ID of the node currently running
+static bool mock_rx; // Set while a frame waits in rf12_buf
+static uint8_t mock_lost; // Number of upcoming frames to lose
+static bool mock_verbose; // Print every frame sent
+static MockFrame mock_air[MOCK_MAX_AIR]; // Frames sent, not delivered
+static size_t mock_n_air;
+
+unsigned long millis()
+{
+	return mock_now;
+}
+
+unsigned long micros()
+{
+	return mock_now * 1000;
+}
+
+uint8_t rf12_initialize(uint8_t id, uint8_t, uint8_t, uint16_t)
+{
+	return id;
+}
+
+uint8_t rf12_recvDone()
+{
+	bool ret = mock_rx;
+	mock_rx = false;
+	return ret;
+}
+
+uint8_t rf12_canSend()
+{
+	return 1;
+}
+
+void rf12_sendStart(uint8_t hdr, const void *ptr, uint8_t len)
+{
+	const uint8_t *b = (const uint8_t *) ptr;
+	if (mock_verbose) {
+		printf("  %lu: node %u sends %02x:", mock_now, mock_me, hdr);
+		for (uint8_t i = 0; i < len; i++)
+			printf(" %02x", b[i]);
+		printf("%s\n", mock_lost ? " (lost)" : "");
+	}
+	if (mock_lost) {
+		mock_lost--;
+		return;
+	}
+	if (mock_n_air >= MOCK_MAX_AIR) {
+		printf("FAIL: too many frames in the air\n");
+		return;
+	}
+	MockFrame *f = mock_air + mock_n_air++;
+	f->from = mock_me;
+	f->hdr = hdr;
+	f->len = len;
+	memcpy(f->data, b, len);
+}
+
+char rf12_sleep(char)
+{
+	return 0;
+}
+
+/// Make 'run' run the node with the given ID.
+void mock_add_node(uint8_t id, mock_run_func run)
+{
+	mock_nodes[id] = run;
+}
+
+/// Run the node with the given ID once, unless it is asleep.
+void mock_run(uint8_t id)
+{
+	if (!mock_nodes[id] || mock_asleep[id])
+		return;
+	mock_me = id;
+	mock_nodes[id]();
+}
+
+void mock_run_all()
+{
+	for (uint8_t id = 0; id < MOCK_MAX_NODES; id++)
+		mock_run(id);
+}
+
+/// Hand the oldest frame in the air to every node that should get it.
+void mock_deliver()
+{
+	MockFrame f = mock_air[0];
+	memmove(mock_air, mock_air + 1, --mock_n_air * sizeof(*mock_air));
+	uint8_t dst = f.hdr & RF12_HDR_DST ? f.hdr & RF12_HDR_MASK : 0;
+	for (uint8_t id = 0; id < MOCK_MAX_NODES; id++) {
+		if (id == f.from || (dst && id != dst && id != 31))
+			continue;
+		if (!mock_nodes[id] || mock_asleep[id])
+			continue;
+		rf12_hdr = f.hdr;
+		rf12_len = f.len;
+		memcpy((uint8_t *) rf12_data, f.data, f.len);
+		rf12_crc = 0;
+		mock_rx = true;
+		mock_run(id);
+		mock_rx = false;
+	}
+}
+
+/**
+ * Run all nodes, one millisecond apart, and deliver the frames they
+ * send, until the network has been quiet for 'idle' milliseconds.
+ */
+void mock_pump(unsigned long idle = 50)
+{
+	unsigned long quiet = 0;
+	while (quiet < idle) {
+		mock_now++;
+		mock_run_all();
+		if (mock_n_air) {
+			mock_deliver();
+			quiet = 0;
+		}
+		else
+			quiet++;
+	}
+}
+
+/// Let 'ms' milliseconds pass without delivering any frames.
+void mock_wait(unsigned long ms)
+{
+	mock_now += ms;
+}
+
+static unsigned int mock_failures;
+
+/// Report a failed check, and count it.
+void mock_check(bool ok, const char *what)
+{
+	if (!ok) {
+		printf("FAIL: %s\n", what);
+		mock_failures++;
+	}
+}
+
+/// Return the exit code of the test, after printing a summary.
+int mock_result()
+{
+	if (mock_failures) {
+		printf("%u failures\n", mock_failures);
+		return 1;
+	}
+	printf("OK\n");
+	return 0;
+}
+
+#endif // RCN_MOCK_NET_H
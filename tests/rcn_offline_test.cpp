@@ -0,0 +1,124 @@
+/*
+ * Scenario test of RCN_Controller's offline mode
+ *
+ * Runs one host and two controllers on a simulated network. One of the
+ * controllers loses contact with the host, while the other one keeps
+ * writing to the same channel. Checks that the intents collected while
+ * offline are applied by the host once contact is restored:
+ *
+ *   g++ -std=gnu++11 -Wall -I.. -Imock rcn_offline_test.cpp \
+ *     -o rcn_offline_test
+ *   ./rcn_offline_test
+ *
+ * Author: Johan Herland <johan@herland.net>
+ * License: GNU GPL v2 or later
+ */
+
+#define RCN_HOST_MAX_CHANNELS 2
+#define RCN_CTRL_MAX_CHANNELS 2
+
+#include <Arduino.h>
+#include <RF12.h>
+#include <rcn_host.h>
+#include <rcn_controller.h>
+
+#include "rcn_mock_net.h"
+
+static uint8_t pass(uint8_t, uint8_t, uint8_t, uint8_t, uint8_t new_level)
+{
+	return new_level;
+}
+
+static void ignore(uint8_t, uint8_t, uint8_t, uint8_t, uint8_t)
+{
+}
+
+RCN_Host host(RF12_868MHZ, 1, remote_host, pass);
+RCN_Controller c1(RF12_868MHZ, 1, 2, ignore);
+RCN_Controller c2(RF12_868MHZ, 1, 3, ignore);
+
+static void run_host() { host.run(); }
+static void run_c1() { c1.run(); }
+static void run_c2() { c2.run(); }
+
+/// Check that the host and both controllers agree on the channel
+static void check_level(uint8_t channel, uint8_t expect, const char *what)
+{
+	bool ok = host.get(channel) == expect && c1.get(channel) == expect
+		&& c2.get(channel) == expect;
+	if (!ok)
+		printf("  host %u, c1 %u, c2 %u, expected %u\n",
+			host.get(channel), c1.get(channel), c2.get(channel),
+			expect);
+	mock_check(ok, what);
+}
+
+/// Make c1 miss enough replies to go offline
+static void lose_contact()
+{
+	mock_asleep[remote_host] = true;
+	for (int i = 0; i < RCN_CTRL_OFFLINE_MISSES; i++) {
+		c1.sync(0);
+		mock_pump();
+		mock_wait(RCN_CTRL_REPLY_TIMEOUT);
+		mock_pump();
+	}
+	mock_asleep[remote_host] = false;
+	mock_check(!c1.online(), "controller goes offline");
+}
+
+/// Let c2 write to the channel 5 times, while c1 hears nothing
+static void write_elsewhere(uint8_t channel, uint8_t level)
+{
+	mock_asleep[2] = true;
+	for (int i = 4; i >= 0; i--) {
+		c2.set(channel, level - i);
+		mock_pump();
+	}
+	mock_asleep[2] = false;
+}
+
+/// Let c1 probe the host, and get back online
+static void regain_contact()
+{
+	mock_wait(RCN_CTRL_PROBE_INTERVAL);
+	mock_pump();
+	mock_check(c1.online(), "controller comes back online");
+}
+
+int main(int argc, char **)
+{
+	mock_verbose = argc > 1;
+	mock_add_node(remote_host, run_host);
+	mock_add_node(2, run_c1);
+	mock_add_node(3, run_c2);
+
+	host.add_channel(0xff, 10);
+	host.add_channel(0xff, 10);
+	c1.add_channel();
+	c1.add_channel();
+	c2.add_channel();
+	c2.add_channel();
+	mock_pump();
+	c1.set(0, 10); // Get the timestamps going
+	c1.set(1, 10);
+	mock_pump();
+	check_level(0, 10, "initial sync");
+
+	// An absolute intent wins over writes made while offline
+	lose_contact();
+	write_elsewhere(0, 54);
+	c1.set(0, 200);
+	regain_contact();
+	check_level(0, 200, "absolute intent is applied on reconnect");
+
+	// A relative intent is applied on top of them
+	lose_contact();
+	write_elsewhere(1, 54);
+	c1.adjust(1, 3);
+	c1.adjust(1, 2);
+	regain_contact();
+	check_level(1, 59, "relative intent is applied on reconnect");
+
+	return mock_result();
+}
@@ -0,0 +1,74 @@
+/*
+ * Round-trip test of the RCN payload encoding in rcn_protocol.h
+ *
+ * Checks RCN_Payload against the bitfield layout that RCN_Node used
+ * before rcn_protocol.h existed (as laid out by GCC, which is what both
+ * avr-gcc and the regular gcc do), for every combination of channel,
+ * relative flag and level. Since rcn_protocol.h only depends on
+ * <stdint.h>, this runs on a regular computer:
+ *
+ *   g++ -std=c++11 -Wall -I.. rcn_protocol_test.cpp -o rcn_protocol_test
+ *   ./rcn_protocol_test
+ *
+ * Author: Johan Herland <johan@herland.net>
+ * License: GNU GPL v2 or later
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <rcn_protocol.h>
+
+/// The payload layout of RCN v1, as originally declared in rcn_node.h
+class Payload
+{
+public:
+	uint8_t channel  : 7; // Channel ID
+	uint8_t relative : 1; // Relative (set) or absolute level
+	union {
+		uint8_t abs_level;
+		int8_t  rel_level;
+	};
+};
+
+static_assert(sizeof(Payload) == RCN_Payload::size,
+	"RCN_Payload::size differs from the original layout");
+
+int main()
+{
+	unsigned int failures = 0;
+
+	for (unsigned int channel = 0; channel < 128; channel++)
+	for (unsigned int relative = 0; relative < 2; relative++)
+	for (unsigned int level = 0; level < 256; level++) {
+		Payload d;
+		memset(&d, 0, sizeof(d));
+		d.channel = channel;
+		d.relative = relative;
+		d.abs_level = level;
+
+		// Encoding must produce the same bytes as the bitfields
+		uint8_t b[RCN_Payload::size];
+		RCN_Payload::encode(b, channel, relative, level);
+		bool ok = !memcmp(b, &d, sizeof(d));
+
+		// Decoding must give back what was encoded
+		ok = ok && RCN_Payload::channel(b) == channel
+			&& RCN_Payload::relative(b) == (bool) relative
+			&& RCN_Payload::abs_level(b) == level
+			&& RCN_Payload::rel_level(b) == d.rel_level;
+
+		if (!ok) {
+			if (failures++ < 10)
+				printf("FAIL: channel %u, relative %u, "
+					"level %u\n", channel, relative, level);
+		}
+	}
+
+	if (failures) {
+		printf("%u failures\n", failures);
+		return 1;
+	}
+	printf("OK\n");
+	return 0;
+}
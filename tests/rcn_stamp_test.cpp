@@ -0,0 +1,114 @@
+/*
+ * Scenario test of the logical timestamps (see rcn_node.h)
+ *
+ * Runs one host and two controllers on a simulated network, and checks
+ * that absolute update requests are only dropped when overtaken by
+ * another write while in flight, and not merely because the controller
+ * has not heard of the host's most recent (local) changes:
+ *
+ *   g++ -std=gnu++11 -Wall -I.. -Imock rcn_stamp_test.cpp -o rcn_stamp_test
+ *   ./rcn_stamp_test
+ *
+ * Author: Johan Herland <johan@herland.net>
+ * License: GNU GPL v2 or later
+ */
+
+#define RCN_HOST_MAX_POLICIES 1
+
+#include <Arduino.h>
+#include <RF12.h>
+#include <rcn_host.h>
+#include <rcn_controller.h>
+
+#include "rcn_mock_net.h"
+
+static uint8_t pass(uint8_t, uint8_t, uint8_t, uint8_t, uint8_t new_level)
+{
+	return new_level;
+}
+
+static void ignore(uint8_t, uint8_t, uint8_t, uint8_t, uint8_t)
+{
+}
+
+RCN_Host host(RF12_868MHZ, 1, remote_host, pass);
+RCN_Controller c1(RF12_868MHZ, 1, 2, ignore);
+RCN_Controller c2(RF12_868MHZ, 1, 3, ignore);
+
+static void run_host() { host.run(); }
+static void run_c1() { c1.run(); }
+static void run_c2() { c2.run(); }
+
+/// Check that the host and both controllers agree on channel #0
+static void check_level(uint8_t expect, const char *what)
+{
+	bool ok = host.get(0) == expect && c1.get(0) == expect
+		&& c2.get(0) == expect;
+	if (!ok)
+		printf("  host %u, c1 %u, c2 %u, expected %u\n",
+			host.get(0), c1.get(0), c2.get(0), expect);
+	mock_check(ok, what);
+}
+
+int main(int argc, char **)
+{
+	mock_verbose = argc > 1;
+	mock_add_node(remote_host, run_host);
+	mock_add_node(2, run_c1);
+	mock_add_node(3, run_c2);
+
+	host.add_channel(0xff, 100);
+	c1.add_channel();
+	c2.add_channel();
+	mock_pump();
+	c1.set(0, 100); // Get the timestamps going
+	mock_pump();
+	check_level(100, "initial sync");
+
+	// A sampling loop re-setting the same level, with its SUs held back
+	host.set_report_policy(0, 5, 10, 0);
+	for (int i = 0; i < 20; i++) {
+		host.set(0, host.get(0));
+		host.run();
+		mock_wait(100);
+	}
+	c1.set(0, 30);
+	mock_pump();
+	check_level(30, "unchanged local sets do not overtake URs");
+
+	// A noisy sampling loop, changing the level within the deadband
+	for (int i = 0; i < 200; i++) {
+		host.set(0, 30 + i % 3);
+		host.run();
+		mock_wait(100);
+	}
+	host.set(0, 30);
+	c2.set(0, 40);
+	mock_pump();
+	check_level(40, "unreported local changes do not overtake URs");
+
+	// A controller that slept through lots of reported changes
+	mock_asleep[3] = true;
+	host.set_report_policy(0, 0, 0, 0);
+	for (int i = 0; i < 300; i++) {
+		host.set(0, i % 100);
+		mock_pump(5);
+		mock_wait(100);
+	}
+	mock_asleep[3] = false;
+	c2.set(0, 50);
+	mock_pump();
+	check_level(50, "a controller far behind is not locked out");
+
+	// An UR overtaken in flight by another controller's second write
+	c1.set(0, 10);
+	mock_run(2);
+	c1.set(0, 11);
+	mock_run(2);
+	c2.set(0, 200);
+	mock_run(3);
+	mock_pump();
+	check_level(11, "URs overtaken in flight are dropped");
+
+	return mock_result();
+}